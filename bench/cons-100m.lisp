@@ -0,0 +1,3 @@
+(= live (list (tree 21) (tree 19)))
+(churn 10)
+(print (atom live))
@@ -0,0 +1,3 @@
+(= live (tree 18))
+(churn 10)
+(print (atom live))
@@ -0,0 +1,4 @@
+(= live (list (tree 21) (tree 21) (tree 21) (tree 21) (tree 21) (tree 21) (tree 21)
+	(tree 21) (tree 21) (tree 21) (tree 21) (tree 21) (tree 21) (tree 21)))
+(churn 10)
+(print (atom live))
@@ -0,0 +1,4 @@
+(defun fib (n)
+	(cond ((eq n 0) 0) ((eq n 1) 1) (t (+ (fib (- n 1)) (fib (- n 2))))))
+
+(print (fib 27))
@@ -0,0 +1,7 @@
+(defun tree (d) (cond ((eq d 0) d) (t (cons (tree (- d 1)) (tree (- d 1))))))
+(defun build (n acc) (cond ((eq n 0) acc) (t (build (- n 1) (cons n acc)))))
+
+(defun churn (n) (cond ((eq n 0) nil) (t (drop (tree 17) (- n 1)))))
+(defun drop (x n) (churn n))
+
+(defun spin (n) (cond ((eq n 0) nil) (t (spin (- n 1)))))
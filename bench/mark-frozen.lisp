@@ -0,0 +1,4 @@
+(= live (list (tree 20) (tree 20)))
+(freeze)
+(spin 1000000)
+(print (atom live))
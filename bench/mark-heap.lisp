@@ -0,0 +1,3 @@
+(= live (list (tree 20) (tree 20)))
+(spin 1000000)
+(print (atom live))
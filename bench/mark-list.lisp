@@ -0,0 +1,3 @@
+(= live (build 1000000 nil))
+(spin 2000000)
+(print (car live))
@@ -0,0 +1,3 @@
+(= live (tree 19))
+(spin 2000000)
+(print (atom live))
@@ -0,0 +1,3 @@
+(defun sum (n acc) (cond ((eq n 0) acc) (t (sum (- n 1) (+ acc n)))))
+
+(print (sum 3000000 0))
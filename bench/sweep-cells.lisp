@@ -0,0 +1,6 @@
+(= live (tree 19))
+(= half (tree 18))
+(churn 20)
+(= half nil)
+(churn 20)
+(print (atom live))
@@ -1,3 +1,7 @@
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,29 +14,83 @@
 
 void grammar_init();
 
-int main(int argc, char **argv) {
-	int i;
+static char *dumpimage, *image;
+static bool gcstats, sizehist;
+
+static double parse_factor(char *str) {
+	char *end;
+	double x;
+
+	x = strtod(str,&end);
+	if(end == str || *end)
+		die("bad number '%s'",str);
+
+	return x;
+}
+
+static unsigned parse_count(char *str) {
+	char *end;
+	double x;
+
+	x = strtod(str,&end);
+	if(end == str || *end || x < 1 || x > UINT_MAX || x != (unsigned) x)
+		die("bad count '%s'",str);
+
+	return x;
+}
+
+// Byte counts may end in k, m or g
+static int64_t parse_size(char *str) {
+	char *end;
+	double x;
+
+	x = strtod(str,&end);
+	switch(*end) {
+	case 'k': case 'K': x *= 1 << 10; end++; break;
+	case 'm': case 'M': x *= 1 << 20; end++; break;
+	case 'g': case 'G': x *= 1 << 30; end++; break;
+	}
+
+	if(end == str || *end || x < 0)
+		die("bad size '%s'",str);
+
+	return x;
+}
+
+// One interpreter, with a heap to itself, running each file in turn on the
+// calling thread
+static void interpret(char **files, int nfiles) {
 	FILE *in;
 	env_t *globals;
-	uint32_t globalsh;
+	uint32_t globalsh, roots[2];
 
-	globalsh = mem_new_handle(GC_TYPE(env_t));
-	globals = mem_set_handle(globalsh,env_cons(NULL));
+	mem_init();
 
-	builtin_init(globals);
+	// A heap image holds everything these reach, builtins included
+	roots[0] = globalsh = mem_new_handle(GC_TYPE(env_t));
+	roots[1] = cell_str_interned_handle();
+
+	if(image) {
+		mem_load_image(image,roots,2);
+		globals = mem_get_handle(globalsh);
+		builtin_restore(globals);
+	} else {
+		globals = mem_set_handle(globalsh,env_cons(NULL,NULL,0));
+		builtin_init(globals);
+	}
 
 	grammar_init();
 
-	if(argc > 1) {
-		for(i = 1; i < argc; i++) {
-			if(strcmp(argv[i],"-") == 0) {
+	if(nfiles) {
+		for(int i = 0; i < nfiles; i++) {
+			if(strcmp(files[i],"-") == 0) {
 				filename = "stdin";
 				run_file(globals,stdin);
 			} else {
-				filename = argv[i];
-				if(in = fopen(argv[i],"r"))
+				filename = files[i];
+				if(in = fopen(files[i],"r"))
 					run_file(globals,in);
-				else die("cannot open '%s'",argv[i]);
+				else die("cannot open '%s'",files[i]);
 				fclose(in);
 			}
 		}
@@ -41,6 +99,107 @@ int main(int argc, char **argv) {
 		run_file(globals,stdin);
 	}
 
-	return 0;
+	if(dumpimage)
+		mem_dump_image(dumpimage,roots,2);
 }
 
+// With --parallel, each file gets an interpreter and a thread of its own
+static void *interpret_thread(void *arg) {
+	interpret(arg,1);
+
+	if(gcstats || sizehist) {
+		flockfile(stderr);
+		fprintf(stderr,"%s:\n",*(char **) arg);
+		if(gcstats)
+			mem_print_stats();
+		if(sizehist)
+			mem_print_size_histogram();
+		funlockfile(stderr);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	bool parallel;
+	char *val;
+	pthread_t *threads;
+
+	parallel = false;
+
+	// The environment can pace the collector too, but options win
+	if(val = getenv("CALYPSO_GC_GROWTH"))
+		mem_set_growth(parse_factor(val));
+	if(val = getenv("CALYPSO_GC_MIN_HEAP"))
+		mem_set_min_heap(parse_size(val));
+	if(val = getenv("CALYPSO_GC_LIMIT"))
+		mem_set_limit(parse_size(val));
+	if(val = getenv("CALYPSO_GC_MARK_BUDGET"))
+		mem_set_mark_budget(parse_count(val));
+
+	// Options come before any files
+	for(i = 1; i < argc && strncmp(argv[i],"--",2) == 0; i++) {
+		if(strcmp(argv[i],"--gc-growth") == 0 && i + 1 < argc)
+			mem_set_growth(parse_factor(argv[++i]));
+		else if(strcmp(argv[i],"--gc-min-heap") == 0 && i + 1 < argc)
+			mem_set_min_heap(parse_size(argv[++i]));
+		else if(strcmp(argv[i],"--gc-limit") == 0 && i + 1 < argc)
+			mem_set_limit(parse_size(argv[++i]));
+		else if(strcmp(argv[i],"--mark-threads") == 0 && i + 1 < argc)
+			mem_set_mark_threads(parse_count(argv[++i]));
+		else if(strcmp(argv[i],"--mark-budget") == 0 && i + 1 < argc)
+			mem_set_mark_budget(parse_count(argv[++i]));
+		else if(strcmp(argv[i],"--sweep-thread") == 0)
+			mem_set_sweep_thread(true);
+		else if(strcmp(argv[i],"--compact") == 0)
+			mem_set_compact(true);
+		else if(strcmp(argv[i],"--huge-pages") == 0)
+			mem_set_huge_pages(true);
+		else if(strcmp(argv[i],"--gc-stats") == 0)
+			gcstats = true;
+		else if(strcmp(argv[i],"--census-sites") == 0)
+			mem_set_census_sites(true);
+		else if(strcmp(argv[i],"--size-histogram") == 0) {
+			mem_set_size_histogram(true);
+			sizehist = true;
+		}
+		else if(strcmp(argv[i],"--image") == 0 && i + 1 < argc)
+			image = argv[++i];
+		else if(strcmp(argv[i],"--dump-image") == 0 && i + 1 < argc)
+			dumpimage = argv[++i];
+		else if(strcmp(argv[i],"--parallel") == 0)
+			parallel = true;
+		else die("bad option '%s'",argv[i]);
+	}
+
+	if(!parallel) {
+		if(gcstats)
+			atexit(mem_print_stats);
+		if(sizehist)
+			atexit(mem_print_size_histogram);
+
+		interpret(argv + i,argc - i);
+
+		return 0;
+	}
+
+	if(i == argc)
+		die("nothing to run in parallel");
+	if(dumpimage)
+		die("cannot dump a heap image from parallel interpreters");
+
+	threads = malloc((argc - i)*sizeof *threads);
+	assert(threads);
+
+	for(int j = i; j < argc; j++)
+		if(pthread_create(threads + j - i,NULL,interpret_thread,argv + j))
+			die("cannot start interpreter thread");
+
+	for(int j = i; j < argc; j++)
+		pthread_join(threads[j - i],NULL);
+
+	free(threads);
+
+	return 0;
+}
@@ -10,33 +10,76 @@
 #include "mem.h"
 #include "util.h"
 
+static void cell_write_barrier(cell_t *cell) {
+	lambda_t *lamb;
+
+	switch(cell_type(cell)) {
+	case VAL_LBA:
+		lamb = cell_lba(cell);
+		mem_write_barrier(GC_TYPE(env_t),&lamb->env);
+		mem_write_barrier(GC_TYPE(cell_t),&lamb->args);
+		mem_write_barrier(GC_TYPE(cell_t),&lamb->body);
+		break;
+
+	case VAL_LST:
+		mem_write_barrier(GC_TYPE(cell_t),&cell->car);
+		mem_write_barrier(GC_TYPE(cell_t),&cell->cdr);
+		break;
+
+	default: break;
+	}
+}
+
 cell_t *cell_cons(cell_t *car, cell_t *cdr) {
 	cell_t *cell;
 
-	cell = mem_alloc(sizeof *cell);
+	cell = mem_alloc_cell();
 	cell->car = car;
 	cell->cdr = cdr;
 
+	cell_write_barrier(cell);
+
 	return cell;
 }
 
 cell_t *cell_cons_t(cell_type_t type, ...) {
 	va_list ap;
 	cell_t *cell;
+	int64_t i64;
+	unsigned char chr;
 
 	va_start(ap,type);
 
+	// Immediates need neither allocation nor a write barrier
+	switch(type) {
+	case VAL_I64:
+		i64 = va_arg(ap,int64_t);
+		if(i64 >= CELL_I64_MIN && i64 <= CELL_I64_MAX) {
+			va_end(ap);
+			return (cell_t *) ((uintptr_t) i64 << CELL_TAG_BITS
+				| CELL_TAG_I64);
+		}
+		break;
+
+	case VAL_CHR:
+		chr = va_arg(ap,int);
+		va_end(ap);
+		return (cell_t *) ((uintptr_t) chr << CELL_TAG_BITS
+			| CELL_TAG_CHR);
+
+	default: break;
+	}
+
 	if(type == VAL_LBA) {
 		cell = mem_alloc((sizeof *cell) + sizeof(lambda_t));
 		memcpy(cell->data,va_arg(ap,lambda_t *),sizeof(lambda_t));
 	} else {
-		cell = mem_alloc(sizeof *cell);
+		cell = mem_alloc_cell();
 		switch(type) {
 		case VAL_NIL: cell->cdr = NULL; break;
 		case VAL_SYM: cell->sym = va_arg(ap,string_t *); break;
-		case VAL_I64: cell->i64 = va_arg(ap,int64_t);    break;
+		case VAL_I64: cell->i64 = i64;                   break;
 		case VAL_DBL: cell->dbl = va_arg(ap,double);     break;
-		case VAL_CHR: cell->chr = va_arg(ap,int);        break;
 		case VAL_STR: cell->str = va_arg(ap,string_t *); break;
 		case VAL_FCN: cell->fcn = va_arg(ap,fcn_t);      break;
 
@@ -46,7 +89,24 @@ cell_t *cell_cons_t(cell_type_t type, ...) {
 
 	va_end(ap);
 
-	cell->car = (void *) type;
+	cell->car = CELL_TYPE_TAG(type);
+
+	cell_write_barrier(cell);
+
+	return cell;
+}
+
+// Only env_resolve() makes these, for the symbols in lambda bodies
+cell_t *cell_cons_symref(string_t *sym, symref_t ref) {
+	cell_t *cell;
+
+	cell = mem_alloc((sizeof *cell) + sizeof ref);
+	cell->car = CELL_RESOLVED_SYM;
+	cell->sym = sym;
+	memcpy(cell->data,&ref,sizeof ref);
+
+	// Nothing else might be keeping it from the intern table's pruning
+	mem_pin_barrier(sym);
 
 	return cell;
 }
@@ -55,25 +115,56 @@ cell_t *cell_dup(cell_t *cell) {
 	size_t len;
 	cell_t *copy;
 
-	switch(cell_type(cell)) {
-	case VAL_STR: len = cell->i64;                         break;
-	case VAL_LBA: len = (sizeof *cell) + sizeof(lambda_t); break;
+	if(CELL_IS_IMMEDIATE(cell))
+		return cell;
 
-	default: len = sizeof *cell; break;
-	}
+	len = cell_size(cell);
 
-	copy = mem_alloc(len);
+	copy = len == sizeof *cell ? mem_alloc_cell() : mem_alloc(len);
 	memcpy(copy,cell,len);
 
+	cell_write_barrier(copy);
+
 	return copy;
 }
 
 cell_type_t cell_type(cell_t *cell) {
 	uintptr_t type;
 
-	type = cell ? (uintptr_t) cell->car : VAL_LST;
+	switch((uintptr_t) cell&CELL_TAG_MASK) {
+	case CELL_TAG_I64: return VAL_I64;
+	case CELL_TAG_CHR: return VAL_CHR;
+	}
+
+	if(!cell)
+		return VAL_LST;
+
+	type = (uintptr_t) cell->car;
+	if(type&CELL_TAG_MASK)
+		return VAL_LST;
+
+	type >>= CELL_TAG_BITS;
+
+	if(type != VAL_NIL && type < NUM_VAL_TYPES)
+		return type;
+
+	return CELL_IS_RESOLVED(cell) ? VAL_SYM : VAL_LST;
+}
+
+int64_t cell_i64(cell_t *cell) {
+	assert(cell_type(cell) == VAL_I64);
 
-	return type != VAL_NIL && type < NUM_VAL_TYPES ? type : VAL_LST;
+	// Shifting back down has to keep the sign
+	if(CELL_IS_IMMEDIATE(cell))
+		return (intptr_t) cell >> CELL_TAG_BITS;
+
+	return cell->i64;
+}
+
+char cell_chr(cell_t *cell) {
+	assert(cell_type(cell) == VAL_CHR);
+
+	return (uintptr_t) cell >> CELL_TAG_BITS;
 }
 
 lambda_t *cell_lba(cell_t *cell) {
@@ -82,6 +173,27 @@ lambda_t *cell_lba(cell_t *cell) {
 	return (lambda_t *) cell->data;
 }
 
+symref_t *cell_symref(cell_t *cell) {
+	assert(cell && !CELL_IS_IMMEDIATE(cell) && CELL_IS_RESOLVED(cell));
+
+	return (symref_t *) cell->data;
+}
+
+// How much room a cell takes up, counting what it keeps after itself
+size_t cell_size(cell_t *cell) {
+	if(!cell || CELL_IS_IMMEDIATE(cell))
+		return sizeof *cell;
+
+	if(CELL_IS_RESOLVED(cell))
+		return (sizeof *cell) + sizeof(symref_t);
+
+	switch(cell_type(cell)) {
+	case VAL_LBA: return (sizeof *cell) + sizeof(lambda_t);
+
+	default: return sizeof *cell;
+	}
+}
+
 bool cell_is_atom(cell_t *cell) {
 	return !cell || cell_type(cell) != VAL_NIL
 		&& cell_type(cell) != VAL_LST;
@@ -95,21 +207,59 @@ bool cell_is_list(cell_t *cell) {
 string_t *cell_str_cons(char *cstr, size_t len) {
 	string_t *str;
 
+	assert(len <= UINT32_MAX);
+
 	str = mem_alloc(sizeof *str + len);
 	memcpy(str->str,cstr,str->len = len);
+	str->hash = htable_hash(cstr,len);
 
 	return str;
 }
 
-string_t *cell_str_intern(string_t *str) {
-	static uint32_t internedh;
-	static htable_t *interned = NULL;
+// The intern table lives behind a handle, so a heap image can replace it
+uint32_t cell_str_interned_handle() {
+	static _Thread_local uint32_t internedh = ~(uint32_t) 0;
 
-	if(!interned) {
+	htable_t *interned;
+
+	// Strings nothing else refers to drop out of it
+	if(internedh == ~(uint32_t) 0) {
 		internedh = mem_new_handle(GC_TYPE(htable_t));
-		interned = mem_set_handle(internedh,htable_cons(0));
+		interned = htable_cons(0);
+		interned->keystrings = true;
+		mem_set_handle(internedh,interned);
+		mem_set_handle_weak(internedh);
+	}
+
+	return internedh;
+}
+
+string_t *cell_str_intern(string_t *str) {
+	htable_t *interned;
+
+	interned = mem_get_handle(cell_str_interned_handle());
+	str = htable_intern(interned,str,sizeof *str + str->len);
+
+	// It might be on its way out of the table, unless this saves it
+	mem_pin_barrier(str);
+
+	return str;
+}
+
+// Interns the string at cstr without making a copy of it first, unless it is
+// new; as the reader does for every symbol it meets
+string_t *cell_str_intern_span(char *cstr, size_t len) {
+	htable_t *interned;
+	string_t *str;
+
+	interned = mem_get_handle(cell_str_interned_handle());
+	if(!(str = htable_intern_span(interned,cstr,len))) {
+		str = cell_str_cons(cstr,len);
+		str = htable_intern(interned,str,sizeof *str + str->len);
 	}
 
-	return htable_intern(interned,str,sizeof *str + str->len);
+	mem_pin_barrier(str);
+
+	return str;
 }
 
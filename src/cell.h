@@ -8,6 +8,35 @@
 #define INTERN_CONST_STRING(cstr) \
 	(cell_str_intern(cell_str_cons((cstr),strlen((cstr)))))
 
+// Small integers and characters are kept in the cell pointer itself; real
+// cells are aligned, so any low bit set means there is no cell behind it
+#define CELL_TAG_BITS 2
+#define CELL_TAG_MASK ((1 << CELL_TAG_BITS) - 1)
+#define CELL_TAG_I64  1
+#define CELL_TAG_CHR  2
+
+#define CELL_IS_IMMEDIATE(cell) ((uintptr_t) (cell)&CELL_TAG_MASK)
+
+// What goes in the car of an atom; shifted so an immediate car never looks
+// like one
+#define CELL_TYPE_TAG(type) ((cell_t *) ((uintptr_t) (type) << CELL_TAG_BITS))
+
+// What goes in the car of a symbol in a lambda body that env_resolve() has
+// been through; it is a symbol to everything but eval, and has a symref_t
+// after it
+#define CELL_RESOLVED_SYM  CELL_TYPE_TAG(VAL_LST + 1)
+
+// What it becomes at the head of a lambda or macro form whose body
+// env_resolve() has been through, so it needn't go through it again
+#define CELL_RESOLVED_HEAD CELL_TYPE_TAG(VAL_LST + 2)
+
+#define CELL_IS_RESOLVED(cell) \
+	((cell)->car == CELL_RESOLVED_SYM || (cell)->car == CELL_RESOLVED_HEAD)
+
+// Integers outside of this range still get a cell of their own
+#define CELL_I64_MIN (INTPTR_MIN >> CELL_TAG_BITS)
+#define CELL_I64_MAX (INTPTR_MAX >> CELL_TAG_BITS)
+
 typedef enum cell_type {
 	VAL_NIL, // Also a list
 	VAL_SYM,
@@ -28,10 +57,14 @@ typedef enum fcn {
 	FCN_ATOM,
 	FCN_CAR,
 	FCN_CDR,
+	FCN_CENSUS,
 	FCN_COND,
 	FCN_CONS,
 	FCN_EQ,
 	FCN_EVAL,
+	FCN_FREEZE,
+	FCN_GC,
+	FCN_GC_STATS,
 	FCN_GENSYM,
 	FCN_LAMBDA,
 	FCN_MACRO,
@@ -49,13 +82,24 @@ typedef enum fcn {
 
 typedef struct lambda {
 	bool ismacro;
+	uint32_t nparams; // The size of a frame for it
 	struct env *env;
 	struct cell *args;
 	struct cell *body;
 } lambda_t;
 
+// Where a symbol was found among the parameters of the frames around it when
+// its lambda was made; env_get_sym() checks before it trusts it
+typedef struct symref {
+	uint32_t depth;
+	uint32_t slot;
+} symref_t;
+
+#define SYMREF_NONE UINT32_MAX
+
 typedef struct string {
-	size_t len;
+	uint32_t len;
+	uint32_t hash; // Of str, so the intern table need never look at it again
 	char str[];
 } string_t;
 
@@ -81,16 +125,23 @@ typedef struct cell {
 
 cell_t *cell_cons(cell_t *, cell_t *);
 cell_t *cell_cons_t(cell_type_t, ...);
+cell_t *cell_cons_symref(string_t *, symref_t);
 cell_t *cell_dup(cell_t *);
 
 cell_type_t cell_type(cell_t *);
+int64_t cell_i64(cell_t *);
+char cell_chr(cell_t *);
 lambda_t *cell_lba(cell_t *);
+symref_t *cell_symref(cell_t *);
+size_t cell_size(cell_t *);
 
 bool cell_is_atom(cell_t *);
 bool cell_is_list(cell_t *);
 
 string_t *cell_str_cons(char *, size_t);
 string_t *cell_str_intern(string_t *);
+string_t *cell_str_intern_span(char *, size_t);
+uint32_t cell_str_interned_handle();
 
 #endif
 
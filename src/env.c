@@ -8,29 +8,252 @@
 #include "htable.h"
 #include "mem.h"
 
-env_t *env_cons(env_t *parent) {
+#define NOT_FOUND UINT32_MAX
+
+// Numbers the symbols in a parameter template from n, in the order bind_args
+// comes across them, naming slots after them if there are any; gives the
+// number after the last
+static uint32_t params_fill(cell_t *template, binding_t *slots, uint32_t n) {
+	if(!template || CELL_IS_IMMEDIATE(template))
+		return n;
+
+	if(cell_type(template) == VAL_SYM) {
+		if(slots) {
+			slots[n].sym = template->sym;
+			slots[n].val = ENV_UNBOUND;
+		}
+
+		return n + 1;
+	}
+
+	if(cell_type(template) != VAL_LST)
+		return n;
+
+	for(; template && cell_type(template) == VAL_LST;
+		template = template->cdr)
+		n = params_fill(template->car,slots,n);
+
+	// Var-args
+	return params_fill(template,slots,n);
+}
+
+static uint64_t params_symbits(binding_t *slots, uint32_t nslots) {
+	uint64_t symbits;
+
+	symbits = 0;
+	for(uint32_t i = 0; i < nslots; i++)
+		symbits |= ENV_SYMBIT(slots[i].sym);
+
+	return symbits;
+}
+
+// Frames are made with their parameters laid out, but not yet bound
+env_t *env_cons(env_t *parent, cell_t *params, uint32_t nparams) {
 	env_t *env;
 
-	env = mem_alloc(sizeof *env);
+	env = mem_alloc(sizeof *env + nparams*sizeof *env->slots);
 	assert(env);
 	env->parent = parent;
-	env->tab = htable_cons(0);
+	env->tab = NULL;
+	env->nslots = nparams;
+	mem_write_barrier(GC_TYPE(env_t),&env->parent);
+
+	if(nparams) {
+		params_fill(params,env->slots,0);
+		env->symbits = params_symbits(env->slots,nparams);
+
+		for(uint32_t i = 0; i < nparams; i++)
+			mem_write_barrier(GC_TYPE(void),&env->slots[i].sym);
+	} else env->symbits = 0;
 
 	return env;
 }
 
+size_t env_size(env_t *env) {
+	return env ? sizeof *env + env->nslots*sizeof *env->slots : 0;
+}
+
 env_t *env_parent(env_t *env) {
 	return env ? env->parent : NULL;
 }
 
+uint32_t env_count_params(cell_t *params) {
+	return params_fill(params,NULL,0);
+}
+
+// The slot sym is bound in, if any; a parameter named twice is only ever
+// bound the first time
+static uint32_t frame_slot(env_t *env, string_t *sym) {
+	if(!(env->symbits&ENV_SYMBIT(sym)))
+		return NOT_FOUND;
+
+	for(uint32_t i = 0; i < env->nslots; i++)
+		if(env->slots[i].sym == sym)
+			return env->slots[i].val == ENV_UNBOUND ? NOT_FOUND : i;
+
+	return NOT_FOUND;
+}
+
+// The frame a lambda is about to get, along with where it is made
+typedef struct scope {
+	env_t *env;
+
+	uint64_t symbits;
+	uint32_t nslots;
+	binding_t *slots;
+} scope_t;
+
+static bool scope_has(scope_t *scope, string_t *sym) {
+	if(!(scope->symbits&ENV_SYMBIT(sym)))
+		return false;
+
+	for(uint32_t i = 0; i < scope->nslots; i++)
+		if(scope->slots[i].sym == sym)
+			return true;
+
+	return false;
+}
+
+// Forms whose arguments are quoted, or will be resolved when they are made into
+// lambdas of their own; only what the operator names now can tell
+static bool is_opaque(scope_t *scope, cell_t *op) {
+	cell_t *val;
+
+	if(!op || CELL_IS_IMMEDIATE(op) || cell_type(op) != VAL_SYM
+		|| scope_has(scope,op->sym) || !env_get(scope->env,op->sym,&val)
+		|| !val || CELL_IS_IMMEDIATE(val))
+		return false;
+
+	switch(cell_type(val)) {
+	case VAL_FCN:
+		return val->fcn == FCN_QUOTE || val->fcn == FCN_QUASIQUOTE
+			|| val->fcn == FCN_LAMBDA || val->fcn == FCN_MACRO;
+
+	case VAL_LBA: return cell_lba(val)->ismacro;
+
+	default: return false;
+	}
+}
+
+static symref_t locate(scope_t *scope, string_t *sym) {
+	env_t *env;
+	uint32_t slot;
+	symref_t ref;
+
+	// A parameter named twice is only ever bound the first time
+	if(scope_has(scope,sym))
+		for(slot = 0; slot < scope->nslots; slot++)
+			if(scope->slots[slot].sym == sym)
+				return (symref_t) { .depth = 0, .slot = slot };
+
+	ref.slot = SYMREF_NONE;
+
+	// Anything in a hashtable might go away, or be shadowed when it comes
+	ref.depth = 1;
+	for(env = scope->env; env && !env->tab; env = env->parent, ref.depth++)
+		if((slot = frame_slot(env,sym)) != NOT_FOUND) {
+			ref.slot = slot;
+			break;
+		}
+
+	return ref;
+}
+
+static void resolve(scope_t *scope, cell_t **sexp) {
+	cell_t *cell;
+
+	cell = *sexp;
+
+	if(!cell || CELL_IS_IMMEDIATE(cell))
+		return;
+
+	if(cell_type(cell) == VAL_SYM) {
+		if(!CELL_IS_RESOLVED(cell)) {
+			*sexp = cell_cons_symref(cell->sym,locate(scope,cell->sym));
+			mem_write_barrier(GC_TYPE(cell_t),sexp);
+		}
+
+		return;
+	}
+
+	if(cell_type(cell) != VAL_LST)
+		return;
+
+	resolve(scope,&cell->car);
+
+	if(is_opaque(scope,cell->car))
+		return;
+
+	for(sexp = &cell->cdr; *sexp && cell_type(*sexp) == VAL_LST;
+		sexp = &(*sexp)->cdr)
+		resolve(scope,&(*sexp)->car);
+
+	resolve(scope,sexp);
+}
+
+// Swaps each symbol that gets evaluated in the body of a lambda or macro form
+// about to be made for one that knows where it will be found, if it is one of
+// the parameters of the lambda or of those around it. A form is only gone
+// through once; the symbol at its head is marked when it has been.
+void env_resolve(env_t *env, cell_t *form) {
+	cell_t *head, *params, *body;
+	scope_t scope;
+
+	head = form->car;
+	if(head && !CELL_IS_IMMEDIATE(head) && head->car == CELL_RESOLVED_HEAD)
+		return;
+
+	params = form->cdr->car;
+	body = form->cdr->cdr;
+
+	scope.env = env;
+	scope.nslots = env_count_params(params);
+
+	binding_t slots[scope.nslots ? scope.nslots : 1];
+
+	scope.slots = slots;
+	params_fill(params,slots,0);
+	scope.symbits = params_symbits(slots,scope.nslots);
+
+	for(; body && cell_type(body) == VAL_LST; body = body->cdr)
+		resolve(&scope,&body->car);
+
+	// A head that isn't a symbol has nowhere to keep the mark
+	if(!head || CELL_IS_IMMEDIATE(head) || cell_type(head) != VAL_SYM)
+		return;
+
+	if(!CELL_IS_RESOLVED(head)) {
+		head = cell_cons_symref(head->sym,(symref_t) {
+			.depth = 0,
+			.slot = SYMREF_NONE
+		});
+		form->car = head;
+		mem_write_barrier(GC_TYPE(cell_t),&form->car);
+	}
+
+	head->car = CELL_RESOLVED_HEAD;
+}
+
 bool env_get(env_t *env, string_t *sym, cell_t **val) {
 	bool exists;
+	uint32_t slot;
 	hvalue_t hval;
 
 	assert(env && sym);
 
-	do exists = htable_lookup(env->tab,&sym,sizeof sym,&hval);
-	while(!exists && (env = env->parent));
+	exists = false;
+
+	do {
+		if((slot = frame_slot(env,sym)) != NOT_FOUND) {
+			if(val)
+				*val = env->slots[slot].val;
+
+			return true;
+		}
+
+		if(env->tab)
+			exists = htable_lookup_ptr(env->tab,sym,&hval);
+	} while(!exists && (env = env->parent));
 
 	if(exists && val)
 		*val = hval.p;
@@ -38,8 +261,62 @@ bool env_get(env_t *env, string_t *sym, cell_t **val) {
 	return exists;
 }
 
+// env_get(), by way of where sym was resolved to, if it is still right; no
+// frame on the way there may have a binding that would come first
+bool env_get_sym(env_t *env, cell_t *sym, cell_t **val) {
+	env_t *frame;
+	uint32_t depth;
+	uint64_t symbit;
+	symref_t *ref;
+	binding_t *binding;
+
+	assert(env && sym);
+
+	if(!CELL_IS_RESOLVED(sym))
+		return env_get(env,sym->sym,val);
+
+	ref = cell_symref(sym);
+
+	if(ref->slot != SYMREF_NONE) {
+		symbit = ENV_SYMBIT(sym->sym);
+
+		for(frame = env, depth = ref->depth; frame && depth; depth--) {
+			if(frame->symbits&symbit || frame->tab)
+				break;
+			frame = frame->parent;
+		}
+
+		if(frame && !depth && ref->slot < frame->nslots) {
+			binding = frame->slots + ref->slot;
+
+			if(binding->sym == sym->sym
+				&& binding->val != ENV_UNBOUND) {
+				if(val)
+					*val = binding->val;
+
+				return true;
+			}
+		}
+	}
+
+	return env_get(env,sym->sym,val);
+}
+
+static void frame_set(env_t *env, string_t *sym, cell_t *val) {
+	if(!env->tab) {
+		env->tab = htable_cons(0);
+		env->tab->keyrefs = true;
+		mem_write_barrier(GC_TYPE(htable_t),&env->tab);
+	}
+
+	htable_insert_ptr(env->tab,sym,(hvalue_t) {
+		.type = GC_TYPE(cell_t),
+		.p = val
+	});
+}
+
 void env_set(env_t *env, string_t *sym, cell_t *val, bool local) {
-	bool exists;
+	uint32_t slot;
 	env_t *localenv;
 
 	assert(env && sym);
@@ -47,16 +324,33 @@ void env_set(env_t *env, string_t *sym, cell_t *val, bool local) {
 	if(!local) {
 		localenv = env;
 
-		do exists = htable_lookup(env->tab,&sym,sizeof sym,NULL);
-		while(!exists && (env = env->parent));
+		do {
+			if((slot = frame_slot(env,sym)) != NOT_FOUND) {
+				env->slots[slot].val = val;
+				mem_write_barrier(GC_TYPE(cell_t),
+					&env->slots[slot].val);
+				return;
+			}
+
+			if(env->tab && htable_lookup_ptr(env->tab,sym,NULL)) {
+				frame_set(env,sym,val);
+				return;
+			}
+		} while(env = env->parent);
 
-		if(!exists)
-			env = localenv;
+		env = localenv;
 	}
 
-	htable_insert(env->tab,&sym,sizeof sym,(hvalue_t) {
-		.type = GC_TYPE(cell_t),
-		.p = val
-	});
+	// Binding a parameter, unless there is no such parameter
+	if(env->symbits&ENV_SYMBIT(sym))
+		for(slot = 0; slot < env->nslots; slot++)
+			if(env->slots[slot].sym == sym) {
+				env->slots[slot].val = val;
+				mem_write_barrier(GC_TYPE(cell_t),
+					&env->slots[slot].val);
+				return;
+			}
+
+	frame_set(env,sym,val);
 }
 
@@ -2,20 +2,43 @@
 #define ENV_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+struct cell;
 struct string;
 
+// A parameter of the lambda whose call made the frame; those the call had no
+// argument for stay unbound, and are passed over as if they weren't there
+typedef struct binding {
+	struct string *sym;
+	struct cell *val;
+} binding_t;
+
+#define ENV_UNBOUND ((struct cell *) 3) // A tag no immediate has
+
 typedef struct env {
 	struct env *parent;
 
-	struct htable *tab;
+	struct htable *tab; // Everything else; NULL until there is any
+
+	uint64_t symbits; // A bit per parameter, by its hash; see ENV_SYMBIT()
+	uint32_t nslots;
+	binding_t slots[];
 } env_t;
 
-env_t *env_cons(env_t *);
+#define ENV_SYMBIT(str) ((uint64_t) 1 << ((str)->hash&63))
+
+env_t *env_cons(env_t *, struct cell *, uint32_t);
+size_t env_size(env_t *);
 
 env_t *env_parent(env_t *);
 
+uint32_t env_count_params(struct cell *);
+void env_resolve(env_t *, struct cell *);
+
 bool env_get(env_t *, struct string *, struct cell **);
+bool env_get_sym(env_t *, struct cell *, struct cell **);
 void env_set(env_t *, struct string *, struct cell *, bool);
 
 #endif
@@ -8,10 +8,10 @@
 #include "token.h"
 #include "util.h"
 
-static string_t *str_quote;
-static string_t *str_quasiquote;
-static string_t *str_unquote;
-static string_t *str_unquote_splicing;
+static _Thread_local string_t *str_quote;
+static _Thread_local string_t *str_quasiquote;
+static _Thread_local string_t *str_unquote;
+static _Thread_local string_t *str_unquote_splicing;
 
 // first is assumed to be already interned
 static cell_t *wrap(string_t *first, cell_t *cell) {
@@ -26,6 +26,13 @@ void grammar_init() {
 	str_quasiquote = INTERN_CONST_STRING("quasiquote");
 	str_unquote = INTERN_CONST_STRING("unquote");
 	str_unquote_splicing = INTERN_CONST_STRING("unquote-splicing");
+
+	// Interned strings only last as long as something refers to them
+	mem_set_handle(mem_new_handle(GC_TYPE_INDIRECT(void)),&str_quote);
+	mem_set_handle(mem_new_handle(GC_TYPE_INDIRECT(void)),&str_quasiquote);
+	mem_set_handle(mem_new_handle(GC_TYPE_INDIRECT(void)),&str_unquote);
+	mem_set_handle(mem_new_handle(GC_TYPE_INDIRECT(void)),
+		&str_unquote_splicing);
 }
 }
 
@@ -56,6 +63,7 @@ s_exp(R) ::= LPAREN s_exp_list(CAR) PERIOD s_exp(CDR) RPAREN. {
 
 		for(tail = R; tail->cdr; tail = tail->cdr);
 		tail->cdr = CDR;
+		mem_write_barrier(GC_TYPE(cell_t),&tail->cdr);
 	}
 s_exp(R) ::= QUOTE s_exp(S). { R = wrap(str_quote,S); }
 s_exp(R) ::= BQUOTE s_exp(S). { R = wrap(str_quasiquote,S); }
@@ -71,6 +79,6 @@ atom(A) ::= CHARACTER(C). { A = cell_cons_t(VAL_CHR,C.chr); }
 atom(A) ::= STRING(S).    { A = cell_cons_t(VAL_STR,S.str); }
 atom(A) ::= SYMBOL(S).    {
 		A = strncmp("nil",S.str->str,S.str->len) == 0 ? NULL
-			: cell_cons_t(VAL_SYM,cell_str_intern(S.str));
+			: cell_cons_t(VAL_SYM,S.str);
 	}
 
@@ -5,17 +5,40 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cell.h"
 #include "htable.h"
 #include "mem.h"
 
-#define THRESH_GROW   0.7
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define THRESH_GROW   0.875 // Counting tombstones
 #define THRESH_SHRINK 0.3
 
 #define RESIZE_FACTOR 2
 
+#define MIN_CAP 4 // Even the smallest table's slots share a group
+
+// Old slots looked at per operation while a resize is under way; plenty to be
+// done with them all long before the new slots can fill up
+#define MIGRATE_STEP 32
+
 #define HASH_SEED 0xb6871303
 
-#define HASH(key, keylen, cap) (murmur3_32(HASH_SEED,(key),(keylen))%(cap))
+#define HASH(key, keylen) murmur3_32(HASH_SEED,(key),(keylen))
+
+// Pointer keys only need their bits mixed; the top half is the best mixed
+#define HASH_PTR(p) ((uint32_t) ((uint64_t) (uintptr_t) (p) \
+	*0x9e3779b97f4a7c15ull >> 32))
+
+// The hash picks a group to start probing at, and what its control byte is
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((hash)&0x7f)
+
+#define NGROUPS(cap) ((cap) < HTABLE_GROUP ? 1 : (cap)/HTABLE_GROUP)
+
+#define NOT_FOUND UINT32_MAX
 
 static uint32_t murmur3_32(uint32_t seed, void *key, size_t keylen) {
 	static const uint32_t r1 = 15, r2 = 13;
@@ -57,33 +80,320 @@ static uint32_t murmur3_32(uint32_t seed, void *key, size_t keylen) {
 	return seed;
 }
 
-static void htable_resize(htable_t *tab, uint32_t cap) {
-	uint32_t index;
-	hentry_t *entry, **entries, *next;
+uint32_t htable_hash(void *key, size_t keylen) {
+	return HASH(key,keylen);
+}
+
+static uint32_t hash_key(htable_t *tab, void *key, size_t keylen) {
+	void *p;
+
+	if(tab->keystrings)
+		return ((string_t *) key)->hash;
+	if(!tab->keyrefs)
+		return HASH(key,keylen);
+
+	memcpy(&p,key,sizeof p);
+
+	return HASH_PTR(p);
+}
+
+static inline int ctz32(uint32_t x) {
+#ifdef __GNUC__
+	return __builtin_ctz(x);
+#else
+	int n;
+
+	for(n = 0; !(x&1); x >>= 1)
+		n++;
+
+	return n;
+#endif
+}
+
+// Which of a group's control bytes are byte, one bit each
+static inline uint32_t group_match(uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+	__m128i group;
+
+	group = _mm_loadu_si128((__m128i *) ctrl);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8(byte)));
+#else
+	uint32_t mask;
+
+	mask = 0;
+	for(int i = 0; i < HTABLE_GROUP; i++)
+		mask |= (uint32_t) (ctrl[i] == byte) << i;
+
+	return mask;
+#endif
+}
+
+// Which of a group's slots are empty or deleted, which both have the high bit
+static inline uint32_t group_match_free(uint8_t *ctrl) {
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i *) ctrl));
+#else
+	uint32_t mask;
+
+	mask = 0;
+	for(int i = 0; i < HTABLE_GROUP; i++)
+		mask |= (uint32_t) !HTABLE_FULL(ctrl[i]) << i;
+
+	return mask;
+#endif
+}
+
+static hslot_t *slots_alloc(uint32_t cap) {
+	hslot_t *slots;
+
+	slots = mem_alloc(HTABLE_SIZE(cap));
+	memset(HTABLE_CTRL(slots,cap),HTABLE_EMPTY,HTABLE_CTRL_SIZE(cap));
+
+	return slots;
+}
+
+// Groups are probed in triangular steps, which visits each of them in turn
+static uint32_t find(hslot_t *slots, uint32_t cap, void *key, size_t keylen,
+	uint32_t hash) {
+	uint8_t *ctrl;
+	hslot_t *slot;
+	uint32_t g, i, mask, ngroups;
+
+	ctrl = HTABLE_CTRL(slots,cap);
+	ngroups = NGROUPS(cap);
+	g = H1(hash)&(ngroups - 1);
+
+	for(uint32_t step = 1;; step++) {
+		mask = group_match(ctrl + g*HTABLE_GROUP,H2(hash));
+
+		for(; mask; mask &= mask - 1) {
+			i = g*HTABLE_GROUP + ctz32(mask);
+			slot = slots + i;
+
+			if(slot->keylen == keylen
+				&& memcmp(HSLOT_KEY(slot),key,keylen) == 0)
+				return i;
+		}
+
+		// Had it been here, it would have gone in the empty slot
+		if(group_match(ctrl + g*HTABLE_GROUP,HTABLE_EMPTY))
+			return NOT_FOUND;
+
+		g = g + step&ngroups - 1;
+	}
+}
+
+// find(), for tables with keyrefs; keys are the same if their addresses are
+static uint32_t find_ptr(hslot_t *slots, uint32_t cap, void *key,
+	uint32_t hash) {
+	void *p;
+	uint8_t *ctrl;
+	hslot_t *slot;
+	uint32_t g, i, mask, ngroups;
+
+	ctrl = HTABLE_CTRL(slots,cap);
+	ngroups = NGROUPS(cap);
+	g = H1(hash)&(ngroups - 1);
+
+	for(uint32_t step = 1;; step++) {
+		mask = group_match(ctrl + g*HTABLE_GROUP,H2(hash));
+
+		for(; mask; mask &= mask - 1) {
+			i = g*HTABLE_GROUP + ctz32(mask);
+			slot = slots + i;
+			if(slot->keylen != sizeof key)
+				continue;
+
+			// Valueless entries keep even pointer keys out of line
+			memcpy(&p,HSLOT_KEY(slot),sizeof p);
+			if(p == key)
+				return i;
+		}
+
+		if(group_match(ctrl + g*HTABLE_GROUP,HTABLE_EMPTY))
+			return NOT_FOUND;
+
+		g = g + step&ngroups - 1;
+	}
+}
+
+// find(), for tables with keystrings; the string is only a span of chars, and
+// keys that hash differently need not be looked at any closer
+static uint32_t find_span(hslot_t *slots, uint32_t cap, char *cstr,
+	size_t len, uint32_t hash) {
+	uint8_t *ctrl;
+	string_t *str;
+	uint32_t g, i, mask, ngroups;
+
+	ctrl = HTABLE_CTRL(slots,cap);
+	ngroups = NGROUPS(cap);
+	g = H1(hash)&(ngroups - 1);
+
+	for(uint32_t step = 1;; step++) {
+		mask = group_match(ctrl + g*HTABLE_GROUP,H2(hash));
+
+		for(; mask; mask &= mask - 1) {
+			i = g*HTABLE_GROUP + ctz32(mask);
+			str = HSLOT_KEY(slots + i);
+
+			if(str->hash == hash && str->len == len
+				&& memcmp(str->str,cstr,len) == 0)
+				return i;
+		}
+
+		if(group_match(ctrl + g*HTABLE_GROUP,HTABLE_EMPTY))
+			return NOT_FOUND;
+
+		g = g + step&ngroups - 1;
+	}
+}
+
+// Takes the first free slot along hash's probe sequence
+static uint32_t claim(htable_t *tab, uint32_t hash) {
+	uint8_t *ctrl;
+	uint32_t g, i, mask, ngroups;
+
+	ctrl = HTABLE_CTRL(tab->slots,tab->cap);
+	ngroups = NGROUPS(tab->cap);
+	g = H1(hash)&(ngroups - 1);
+
+	for(uint32_t step = 1;; step++) {
+		mask = group_match_free(ctrl + g*HTABLE_GROUP);
+
+		// Small tables pad their only group out with empties
+		if(tab->cap < HTABLE_GROUP)
+			mask &= (1u << tab->cap) - 1;
+
+		if(mask) {
+			i = g*HTABLE_GROUP + ctz32(mask);
+			if(ctrl[i] == HTABLE_DELETED)
+				tab->ndeleted--;
+			ctrl[i] = H2(hash);
+
+			return i;
+		}
+
+		g = g + step&ngroups - 1;
+	}
+}
+
+static void slot_set_value(hslot_t *slot, hvalue_t val) {
+	slot->type = val.type;
+
+	if(val.type == GC_TYPE(etc))
+		slot->i = val.i;
+	else slot->p = val.p;
+}
+
+// Puts a slot's contents somewhere else in the table, as they are
+static hslot_t *move(htable_t *tab, hslot_t *from, bool barriers) {
+	hslot_t *slot;
+
+	slot = tab->slots + claim(tab,hash_key(tab,HSLOT_KEY(from),
+		from->keylen));
+	*slot = *from;
+
+	if(!barriers)
+		return slot;
+
+	if(!HSLOT_KEY_INLINE(slot))
+		mem_write_barrier(GC_TYPE(void),&slot->key);
+	mem_write_barrier(slot->type,&slot->p);
+
+	return slot;
+}
+
+// Moves over the next n old slots' worth of entries, if a resize is under way;
+// those left behind are deleted, so they can't come back once removed
+static void migrate(htable_t *tab, uint32_t n) {
+	uint8_t *ctrl;
+	uint32_t end;
+
+	if(!tab->oldslots)
+		return;
 
+	ctrl = HTABLE_CTRL(tab->oldslots,tab->oldcap);
+	end = tab->oldcap - tab->migrated > n ? tab->migrated + n
+		: tab->oldcap;
+
+	for(; tab->migrated < end; tab->migrated++) {
+		if(!HTABLE_FULL(ctrl[tab->migrated]))
+			continue;
+
+		move(tab,tab->oldslots + tab->migrated,true);
+		ctrl[tab->migrated] = HTABLE_DELETED;
+	}
+
+	if(tab->migrated == tab->oldcap)
+		tab->oldslots = NULL;
+}
+
+// Starts the entries moving into new slots; every operation from then on
+// moves a few more, so no one of them has to move them all
+static void htable_resize(htable_t *tab, uint32_t cap) {
 	// Obey the hashtable's creator
 	if(cap < tab->mincap)
 		cap = tab->mincap;
+	if(cap < MIN_CAP)
+		cap = MIN_CAP;
 
-	// Sanity check
-	if(cap == tab->cap)
+	// Sanity check; at the same size, this only sweeps out the tombstones
+	if(cap == tab->cap && !tab->ndeleted)
 		return;
 
-	entries = mem_alloc(cap*sizeof *entries);
-	memset(entries,0,cap*sizeof *entries);
-
-	for(uint32_t i = 0; i < tab->cap; i++) {
-		for(entry = tab->entries[i]; entry; entry = next) {
-			index = HASH(entry->key,entry->keylen,cap);
+	// Rare, given MIGRATE_STEP
+	htable_settle(tab);
 
-			next = entry->next;
-			entry->next = entries[index];
-			entries[index] = entry;
-		}
-	}
+	tab->oldslots = tab->slots;
+	tab->oldcap = tab->cap;
+	tab->migrated = 0;
 
 	tab->cap = cap;
-	tab->entries = entries;
+	tab->ndeleted = 0;
+	tab->slots = slots_alloc(cap);
+	mem_object_barrier(GC_TYPE(htable_t),tab);
+
+	migrate(tab,MIGRATE_STEP);
+}
+
+// Finishes any resize under way
+void htable_settle(htable_t *tab) {
+	if(tab->oldslots)
+		migrate(tab,tab->oldcap);
+}
+
+// The slot key is in, whether or not a resize has moved it over yet
+static hslot_t *lookup(htable_t *tab, void *key, size_t keylen,
+	uint32_t hash) {
+	uint32_t index;
+
+	migrate(tab,MIGRATE_STEP);
+
+	if((index = find(tab->slots,tab->cap,key,keylen,hash)) != NOT_FOUND)
+		return tab->slots + index;
+
+	if(tab->oldslots && (index = find(tab->oldslots,tab->oldcap,key,
+		keylen,hash)) != NOT_FOUND)
+		return tab->oldslots + index;
+
+	return NULL;
+}
+
+// lookup(), by way of find_ptr()
+static hslot_t *lookup_ptr(htable_t *tab, void *key, uint32_t hash) {
+	uint32_t index;
+
+	migrate(tab,MIGRATE_STEP);
+
+	if((index = find_ptr(tab->slots,tab->cap,key,hash)) != NOT_FOUND)
+		return tab->slots + index;
+
+	if(tab->oldslots && (index = find_ptr(tab->oldslots,tab->oldcap,key,
+		hash)) != NOT_FOUND)
+		return tab->oldslots + index;
+
+	return NULL;
 }
 
 htable_t *htable_cons(uint32_t mincap) {
@@ -91,103 +401,226 @@ htable_t *htable_cons(uint32_t mincap) {
 
 	tab = mem_alloc(sizeof *tab);
 
-	tab->cap = 1 << (int) (log2((mincap ? mincap : 0x10) - 1) + 1);
-	tab->mincap = mincap;
+	tab->cap = 1 << (int) (log2((mincap > MIN_CAP ? mincap : MIN_CAP) - 1)
+		+ 1);
+	tab->mincap = mincap ? tab->cap : 0;
 	tab->nentries = 0;
-	tab->entries = mem_alloc(tab->cap*sizeof *tab->entries);
-	memset(tab->entries,0,tab->cap*sizeof *tab->entries);
+	tab->ndeleted = 0;
+	tab->oldcap = 0;
+	tab->migrated = 0;
+	tab->keyrefs = false;
+	tab->keystrings = false;
+	tab->pruned = false;
+	tab->slots = slots_alloc(tab->cap);
+	tab->oldslots = NULL;
 
 	return tab;
 }
 
-void htable_insert(htable_t *tab, void *key, size_t keylen, hvalue_t val) {
-	uint32_t index;
-	hentry_t *entry;
+// Gives a slot that is already key's a new value; key might have to move in
+// or out of the slot if the value comes or goes
+static void update(hslot_t *slot, void *key, size_t keylen, hvalue_t val) {
+	bool wasinline;
 
-	index = HASH(key,keylen,tab->cap);
+	wasinline = HSLOT_KEY_INLINE(slot);
+	slot_set_value(slot,val);
 
-	for(entry = tab->entries[index]; entry; entry = entry->next) {
-		if(entry->keylen == keylen
-			&& memcmp(entry->key,key,keylen) == 0) {
-			// key is already in tab
-			entry->val = val;
-			return;
-		}
+	if(wasinline && !HSLOT_KEY_INLINE(slot)) {
+		slot->key = mem_dup(key,keylen);
+		mem_write_barrier(GC_TYPE(void),&slot->key);
+	} else if(!wasinline && HSLOT_KEY_INLINE(slot))
+		memcpy(slot->keybytes,key,keylen);
+
+	mem_write_barrier(val.type,&slot->p);
+}
+
+static void insert_new(htable_t *tab, void *key, size_t keylen,
+	uint32_t hash, hvalue_t val) {
+	hslot_t *slot;
+
+	slot = tab->slots + claim(tab,hash);
+	slot->keylen = keylen;
+	slot_set_value(slot,val);
+
+	if(HSLOT_KEY_INLINE(slot))
+		memcpy(slot->keybytes,key,keylen);
+	else {
+		slot->key = tab->keystrings ? key : mem_dup(key,keylen);
+		mem_write_barrier(GC_TYPE(void),&slot->key);
 	}
 
-	// key isn't in tab (yet)
-	entry = mem_alloc(sizeof *entry);
-	entry->key = mem_dup(key,keylen);
-	entry->keylen = keylen;
-	entry->val = val;
-	entry->next = tab->entries[index];
+	mem_write_barrier(val.type,&slot->p);
 
-	tab->entries[index] = entry;
+	if(tab->keyrefs)
+		mem_pin_barrier(*(void **) key);
 
-	// Too many entries?
-	if(++tab->nentries > THRESH_GROW*tab->cap)
-		htable_resize(tab,RESIZE_FACTOR*tab->cap);
+	// Too many entries, counting the deleted ones? Those alone only call
+	// for a clean copy. Or too few, since pruning never resizes?
+	if(++tab->nentries + tab->ndeleted > THRESH_GROW*tab->cap)
+		htable_resize(tab,tab->nentries > tab->cap/2
+			? RESIZE_FACTOR*tab->cap : tab->cap);
+	else if(tab->pruned) {
+		if(tab->nentries < THRESH_SHRINK*tab->cap)
+			htable_resize(tab,tab->cap/RESIZE_FACTOR);
+		else tab->pruned = false;
+	}
 }
 
-bool htable_lookup(htable_t *tab, void *key, size_t keylen, hvalue_t *val) {
-	uint32_t index;
-	hentry_t *entry;
+static void get_value(hslot_t *slot, hvalue_t *val) {
+	val->type = slot->type;
+
+	if(slot->type == GC_TYPE(etc))
+		val->i = slot->i;
+	else val->p = slot->p;
+}
 
-	index = HASH(key,keylen,tab->cap);
+void htable_insert(htable_t *tab, void *key, size_t keylen, hvalue_t val) {
+	uint32_t hash;
+	hslot_t *slot;
 
-	for(entry = tab->entries[index]; entry; entry = entry->next) {
-		if(entry->keylen == keylen
-			&& memcmp(entry->key,key,keylen) == 0) {
-			if(val) *val = entry->val;
-			return true;
-		}
-	}
+	hash = hash_key(tab,key,keylen);
+
+	if(slot = lookup(tab,key,keylen,hash))
+		update(slot,key,keylen,val);
+
+	// key isn't in tab (yet)
+	else insert_new(tab,key,keylen,hash,val);
+}
+
+bool htable_lookup(htable_t *tab, void *key, size_t keylen, hvalue_t *val) {
+	hslot_t *slot;
 
 	// key isn't in tab
-	return false;
+	if(!(slot = lookup(tab,key,keylen,hash_key(tab,key,keylen))))
+		return false;
+
+	if(val)
+		get_value(slot,val);
+
+	return true;
 }
 
-void htable_remove(htable_t *tab, void *key, size_t keylen) {
-	uint32_t index;
-	hentry_t *entry, *prev;
+// For tables with keyrefs, which are keyed on the pointer itself
+void htable_insert_ptr(htable_t *tab, void *key, hvalue_t val) {
+	uint32_t hash;
+	hslot_t *slot;
+
+	hash = HASH_PTR(key);
 
-	index = HASH(key,keylen,tab->cap);
+	if(slot = lookup_ptr(tab,key,hash))
+		update(slot,&key,sizeof key,val);
+	else insert_new(tab,&key,sizeof key,hash,val);
+}
+
+bool htable_lookup_ptr(htable_t *tab, void *key, hvalue_t *val) {
+	hslot_t *slot;
 
-	for(prev = NULL, entry = tab->entries[index]; entry;
-		prev = entry, entry = entry->next) {
-		if(entry->keylen == keylen
-			&& memcmp(entry->key,key,keylen) == 0) {
-			if(prev)
-				prev->next = entry->next;
-			else tab->entries[index] = entry->next;
+	if(!(slot = lookup_ptr(tab,key,HASH_PTR(key))))
+		return false;
 
-			// Too few entries?
-			if(--tab->nentries > THRESH_SHRINK*tab->cap)
-				htable_resize(tab,tab->cap/RESIZE_FACTOR);
+	if(val)
+		get_value(slot,val);
 
-			return;
+	return true;
+}
+
+void htable_remove(htable_t *tab, void *key, size_t keylen) {
+	uint8_t *ctrl, *group;
+	uint32_t hash, index;
+
+	hash = hash_key(tab,key,keylen);
+	migrate(tab,MIGRATE_STEP);
+
+	if((index = find(tab->slots,tab->cap,key,keylen,hash)) != NOT_FOUND) {
+		ctrl = HTABLE_CTRL(tab->slots,tab->cap);
+		group = ctrl + index/HTABLE_GROUP*HTABLE_GROUP;
+
+		// A group that still has an empty slot was never full, so no
+		// probe ever went past it, and the slot can be empty again too
+		if(group_match(group,HTABLE_EMPTY))
+			ctrl[index] = HTABLE_EMPTY;
+		else {
+			ctrl[index] = HTABLE_DELETED;
+			tab->ndeleted++;
 		}
+
+		memset(tab->slots + index,0,sizeof *tab->slots);
 	}
 
+	// Old slots are on their way out anyway
+	else if(tab->oldslots && (index = find(tab->oldslots,tab->oldcap,key,
+		keylen,hash)) != NOT_FOUND)
+		HTABLE_CTRL(tab->oldslots,tab->oldcap)[index] = HTABLE_DELETED;
+
 	// key isn't in tab
+	else return;
+
+	// Too few entries?
+	if(--tab->nentries < THRESH_SHRINK*tab->cap)
+		htable_resize(tab,tab->cap/RESIZE_FACTOR);
 }
 
 void *htable_intern(htable_t *tab, void *key, size_t keylen) {
-	uint32_t index;
-	hentry_t *entry;
-
-	while(true) {
-		index = HASH(key,keylen,tab->cap);
+	uint32_t hash;
+	hslot_t *slot;
 
-		for(entry = tab->entries[index]; entry; entry = entry->next)
-			if(entry->keylen == keylen
-				&& memcmp(key,entry->key,keylen) == 0)
-				return entry->key;
+	hash = hash_key(tab,key,keylen);
 
-		htable_insert(tab,key,keylen,(hvalue_t) {
+	// Valueless keys are never in their slots, so the copy stays put
+	if(!(slot = lookup(tab,key,keylen,hash))) {
+		insert_new(tab,key,keylen,hash,(hvalue_t) {
 			.type = GC_TYPE(etc),
 			.p = NULL
 		});
+
+		slot = lookup(tab,key,keylen,hash);
 	}
+
+	return slot->key;
+}
+
+// The string already interned with the given contents, or NULL; nothing is
+// allocated, so callers only need to make a string when this fails
+void *htable_intern_span(htable_t *tab, char *cstr, size_t len) {
+	uint32_t hash, index;
+
+	assert(tab->keystrings);
+
+	hash = HASH(cstr,len);
+	migrate(tab,MIGRATE_STEP);
+
+	if((index = find_span(tab->slots,tab->cap,cstr,len,hash)) != NOT_FOUND)
+		return tab->slots[index].key;
+
+	if(tab->oldslots && (index = find_span(tab->oldslots,tab->oldcap,cstr,
+		len,hash)) != NOT_FOUND)
+		return tab->oldslots[index].key;
+
+	return NULL;
 }
 
+// Puts every entry back where its hash says; for when keys have changed in
+// place, as pointers do when a heap image is relocated. The collector is not
+// told, so this is only for tables it cannot have seen yet.
+void htable_rehash(htable_t *tab) {
+	uint8_t *ctrl;
+	hslot_t *old;
+
+	assert(!tab->oldslots);
+
+	old = malloc(HTABLE_SIZE(tab->cap));
+	assert(old);
+	memcpy(old,tab->slots,HTABLE_SIZE(tab->cap));
+
+	ctrl = HTABLE_CTRL(tab->slots,tab->cap);
+	memset(ctrl,HTABLE_EMPTY,HTABLE_CTRL_SIZE(tab->cap));
+	memset(tab->slots,0,tab->cap*sizeof *tab->slots);
+	tab->ndeleted = 0;
+
+	ctrl = HTABLE_CTRL(old,tab->cap);
+	for(uint32_t i = 0; i < tab->cap; i++)
+		if(HTABLE_FULL(ctrl[i]))
+			move(tab,old + i,false);
+
+	free(old);
+}
@@ -15,30 +15,72 @@ typedef struct hvalue {
 	};
 } hvalue_t;
 
-typedef struct hentry {
-	struct hentry *next;
-
-	void *key;
+// Keys no longer than a pointer are kept in the slot itself, unless they are
+// valueless: those are interned, and so must stay where they are
+typedef struct hslot {
+	union {
+		void *key;
+		char keybytes[sizeof(void *)];
+	};
 	uint32_t keylen;
 
-	hvalue_t val;
-} hentry_t;
+	// The value, flattened to keep slots small
+	gc_type_t type;
+	union {
+		void *p;
+		uint32_t i;
+	};
+} hslot_t;
+
+#define HSLOT_KEY_INLINE(slot) ((slot)->keylen <= sizeof(void *) \
+	&& (slot)->type != GC_TYPE(etc))
+#define HSLOT_KEY(slot) (HSLOT_KEY_INLINE(slot) ? (void *) (slot)->keybytes \
+	: (slot)->key)
+
+// Slots are followed by a control byte each, and at least a group's worth
+#define HTABLE_GROUP 16
+#define HTABLE_CTRL(slots, cap) ((uint8_t *) ((slots) + (cap)))
+#define HTABLE_CTRL_SIZE(cap) ((cap) < HTABLE_GROUP ? HTABLE_GROUP : (cap))
+#define HTABLE_SIZE(cap) ((cap)*sizeof(hslot_t) + HTABLE_CTRL_SIZE(cap))
+
+// A control byte with the high bit clear is a full slot's hash, or part of it
+#define HTABLE_EMPTY   0x80
+#define HTABLE_DELETED 0xfe
+#define HTABLE_FULL(ctrl) (!((ctrl)&0x80))
 
 typedef struct htable {
 	uint32_t cap;
 	uint32_t mincap;
 
-	uint32_t nentries;
-	hentry_t **entries;
+	uint32_t nentries; // Old slots' too
+	uint32_t ndeleted; // Tombstones, which probes still have to get past
+
+	// While a resize is under way, the old slots, and how many of them have
+	// had their entries moved over
+	uint32_t oldcap;
+	uint32_t migrated;
+
+	bool keyrefs; // Keys are pointers to objects, compared by address
+	bool keystrings; // Keys are strings, kept as given and hashed already
+	bool pruned; // The collector dropped entries; inserts shrink it to fit
+
+	hslot_t *slots;
+	hslot_t *oldslots;
 } htable_t;
 
+uint32_t htable_hash(void *, size_t);
+
 htable_t *htable_cons(uint32_t);
 
 void htable_insert(htable_t *, void *, size_t, hvalue_t);
 bool htable_lookup(htable_t *, void *, size_t, hvalue_t *);
+void htable_insert_ptr(htable_t *, void *, hvalue_t);
+bool htable_lookup_ptr(htable_t *, void *, hvalue_t *);
 void htable_remove(htable_t *, void *, size_t);
 
 void *htable_intern(htable_t *, void *, size_t);
+void *htable_intern_span(htable_t *, char *, size_t);
+void htable_rehash(htable_t *);
+void htable_settle(htable_t *);
 
 #endif
-
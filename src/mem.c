@@ -1,11 +1,22 @@
+#define _DEFAULT_SOURCE // For madvise()
+
 #include <assert.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cell.h"
 #include "env.h"
@@ -16,15 +27,106 @@
 #include "util.h"
 #include "va_macro.h"
 
-#define GC_NUM_BITS   2
-#define GC_USE_GROWTH 5
+#define GC_NUM_BITS 2
+
+#ifndef GC_USE_GROWTH
+#define GC_USE_GROWTH 5 // Default allocation between cycles, over live data
+#endif
+
+#ifndef GC_MIN_HEAP
+#define GC_MIN_HEAP (4 << 20) // Default allocation a cycle waits for at least
+#endif
+
+#ifndef GC_HEADROOM
+#define GC_HEADROOM (gcgrowth + 1) // Heap kept, in multiples of live data
+#endif
+
+// Even up against the soft limit, allow this much growth over live data
+#define GC_LIMIT_MIN_GROWTH 0.25
+
+#ifndef GC_MARK_BUDGET
+#define GC_MARK_BUDGET 4096 // Gray objects scanned per safepoint
+#endif
+
+#ifndef GC_MARK_THREADS
+#define GC_MARK_THREADS 1 // Default number of parallel markers
+#endif
+
+#ifndef GC_MAX_MARK_THREADS
+#define GC_MAX_MARK_THREADS 256
+#endif
+
+#ifndef GC_SWEEP_THREAD
+#define GC_SWEEP_THREAD 0 // Whether to sweep in the background by default
+#endif
+
+#ifndef GC_COMPACT
+#define GC_COMPACT 0 // Whether to evacuate sparse buddy arenas by default
+#endif
+
+#ifndef GC_ARENA_SPACE
+#define GC_ARENA_SPACE (64ll << 30) // Address space reserved for arenas at once
+#endif
+
+#ifndef GC_HUGE_PAGES
+#define GC_HUGE_PAGES 0 // Whether to ask for transparent huge pages by default
+#endif
+
+#define MAX_ARENA_SPACES 16
+
+// Large objects get pages of their own, with the arena header just before
+#define LARGE_HEADSIZE ((offsetof(arena_t,data) + alignof(max_align_t) - 1) \
+	&~(alignof(max_align_t) - 1))
+
+#define FIXED_MAX_SIZE 128 // Largest size class
+
+#define SIZE_HIST_EXACT 256 // Allocation sizes counted exactly up to here
+
+#ifndef CENSUS_TOP_ROOTS
+#define CENSUS_TOP_ROOTS 16 // Roots a census lists, biggest first
+#endif
+
+// Heap images are laid out as immortal arenas, objects aligned to a granule
+#define IMAGE_MAGIC    "calypso"
+#define IMAGE_VERSION  6
+#define IMAGE_GRANULE  8
+#define IMAGE_HEADSIZE ((offsetof(arena_t,data) + 15)&~15)
+
+// Images mapped here need no relocation, and so only fault in what is used
+#ifndef IMAGE_BASE
+#define IMAGE_BASE ((uintptr_t) (UINT64_C(1) << 44))
+#endif
+
+#define COMPACT_THRESH 0.5  // Buddy fragmentation that sets off compaction
+#define COMPACT_SPARSE 0.25 // Occupancy under which a buddy arena is evacuated
+
+#define MARK_RING_SIZE 1024 // Initial capacity of each marker's deque
+#define MARK_SLICE     64   // Budget claimed by a marker at a time
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch((p))
+#else
+#define PREFETCH(p) ((void) (p))
+#endif
+
+#define NURSERY_SIZE   (4*ARENA_SIZE)
+#define NURSERY_THRESH 0.75 // Fill fraction that triggers a minor cycle
+
+// Marks a nursery cell that has been copied out; cdr is the new address
+#define NURSERY_FORWARDED CELL_TYPE_TAG(NUM_VAL_TYPES)
+
+// Immediates are never young, whatever their bits happen to look like
+#define IS_YOUNG(p) (!CELL_IS_IMMEDIATE(p) \
+	&& (uintptr_t) (p) - (uintptr_t) heap->nursery \
+	< (uintptr_t) (heap->nurserytop - heap->nursery))
 
 #define GC_COLOR(bit0, bit1, flags) ((flags) & ((bit0) | (bit1)))
 #define GC_FREE                     0
-#define GC_WHITE(bit0, bit1)        (gcinvert ? (bit0) : (bit1))
-#define GC_BLACK(bit0, bit1)        (gcinvert ? (bit1) : (bit0))
+#define GC_WHITE(bit0, bit1)        (heap->gcinvert ? (bit0) : (bit1))
+#define GC_BLACK(bit0, bit1)        (heap->gcinvert ? (bit1) : (bit0))
 
 #define FIXED_GC_MASK(i) (3 << (i))
+#define FIXED_GC_BIT0S   0x5555555555555555ull // Every block's low bit
 
 #define FIXED_GC_COLOR(flags, i) GC_COLOR(1 << (i),2 << (i),(flags))
 #define FIXED_GC_FREE            GC_FREE
@@ -57,9 +159,17 @@ static_assert((BUDDY_MAX_EXP - BUDDY_MIN_EXP&BUDDY_SIZE_MASK)
 #define ARENA_FIXED     0x00000000ul
 #define ARENA_BUDDY     0x00000001ul
 #define ARENA_LARGE     0x00000002ul
+#define ARENA_IMAGE     0x00000003ul
 
 #define ARENA_NEW       0x00000004ul
 
+// For buddy arenas being compacted
+#define ARENA_EVACUATE  0x00000020ul // Live blocks get moved out this cycle
+#define ARENA_PINNED    0x00000040ul // Holds something that must stay put
+
+// Never marked through or swept; see mem_freeze()
+#define ARENA_IMMORTAL  0x00000080ul
+
 // For large-alloc arenas
 #define ARENA_GC_MASK   (ARENA_GC1 | ARENA_GC2)
 #define ARENA_GC1       0x00000008ul
@@ -74,6 +184,11 @@ static_assert((BUDDY_MAX_EXP - BUDDY_MIN_EXP&BUDDY_SIZE_MASK)
 	((uint8_t *) ((arena)->data + BUDDY_META_BYTES \
 		*((char *) (p) - (arena)->blocks)/BUDDY_MIN_ALLOC))
 
+#define BUDDY_UNIT(arena, p) \
+	(((char *) (p) - (arena)->blocks)/BUDDY_MIN_ALLOC)
+
+#define NOT_MOVED UINT16_MAX
+
 typedef struct free_block {
 	struct free_block *next;
 } free_block_t;
@@ -88,66 +203,507 @@ static_assert(sizeof(bi_free_block_t) <= BUDDY_MIN_ALLOC,
 typedef struct arena {
 	struct arena *next;
 
-	size_t size;
+	size_t size; // Live bytes, more or less, for buddy arenas
 	uint32_t flags;
 	char *blocks;
 
 	free_block_t *freelist;
+	uint16_t *moved; // Per minimum block, how far back its evacuee starts
 
 	char data[];
 } arena_t;
 
-static struct {
-	const size_t size;
-	arena_t *arenas;
-} fixedarenas[] = {
-	{8,NULL},
-	{16,NULL},
-	{32,NULL},
-	{0,NULL}
+// Fitted to what actually gets allocated (see --size-histogram)
+static const size_t fixedsizes[] = {
+	16,  // Cells
+	24,  // Resolved symbol cells
+	32,  // Short strings, global environments
+	48,  // Lambda cells, hashtables, frames of one parameter
+	64,  // Frames of two
+	112, // Minimum-size hashtable slot arrays
+	128,
+	0
+};
+
+// Size class of each size up to FIXED_MAX_SIZE, in steps of 8 bytes
+static uint8_t fixedclasses[FIXED_MAX_SIZE/8 + 1];
+static pthread_once_t fixedclassesonce = PTHREAD_ONCE_INIT;
+
+// What immortal objects have been made to point to since they were frozen
+typedef struct immortal_ref {
+	void *p;
+	gc_type_t type;
+	bool whole; // p is an object to rescan rather than a slot
+} immortal_ref_t;
+
+// Reserved address space that arenas are carved out of, in order; anything
+// outside of it is a large object
+struct arena_space {
+	char *base, *top, *end;
 };
 
-static struct {
+typedef struct gray {
 	gc_type_t type;
 	void *p;
-} *handles; // For non-stack allocations
-static uint32_t maxhandles, nhandles;
+} gray_t;
+
+// Chase-Lev work-stealing deque storage
+typedef struct gray_ring {
+	struct gray_ring *prev; // Outgrown, but thieves may still be reading it
+	int64_t size;
+
+	struct {
+		_Atomic int type;
+		void *_Atomic p;
+	} slots[];
+} gray_ring_t;
+
+typedef struct marker {
+	pthread_t thread;
+	struct heap *heap;
+
+	alignas(64) _Atomic int64_t top;    // Thieves take from here
+	alignas(64) _Atomic int64_t bottom; // The owner works from here
+	gray_ring_t *_Atomic ring;
+
+	int64_t allocd, scanned; // Folded into the totals after each drain
+	unsigned seed;           // For picking victims
+
+	void **slots; // Recorded for compaction, also folded in
+	size_t maxslots, nslots;
+} marker_t;
+
+// Open addressing on address
+typedef struct ptr_map {
+	struct ptr_map_slot {
+		void *p;
+		uint32_t val;
+	} *slots;
+	size_t cap, n;
+} ptr_map_t;
+
+typedef struct alloc_site {
+	const char *name, *file;
+	uint32_t line;
+} alloc_site_t;
+
+// Settings, which every heap shares
+static bool sweepthread = GC_SWEEP_THREAD;
+static bool hugepages = GC_HUGE_PAGES;
+static bool gccompact = GC_COMPACT;
+static unsigned nmarkers = GC_MARK_THREADS;
+
+static double gcgrowth = GC_USE_GROWTH;
+static int64_t gcminheap = GC_MIN_HEAP;
+static int64_t gclimit = 0; // Soft; none if 0
+static size_t gcmarkbudget = GC_MARK_BUDGET;
+
+static bool sizehist;
+static bool censussites;
+
+// Everything else belongs to a single interpreter; nothing in one heap ever
+// points into another, so interpreters on different threads never meet
+typedef struct heap {
+	struct {
+		size_t size;
+		arena_t *arenas;  // Swept, with free blocks left
+		arena_t *full;    // Swept, but with no free blocks
+		arena_t *unswept; // Waiting to be swept; guarded by sweepmutex
+		arena_t *swept;   // Swept by the sweeper; guarded by sweepmutex
+	} fixedarenas[sizeof fixedsizes/sizeof *fixedsizes];
+
+	struct {
+		gc_type_t type;
+		void *p;
+		bool weak; // See mem_set_handle_weak()
+	} *handles; // For non-stack allocations
+	uint32_t maxhandles, nhandles;
+
+	arena_t *buddyarenas;
+	arena_t **buddyunswept; // Where to resume sweeping
+	bi_free_block_t buddyfree[BUDDY_MAX_EXP];
+
+	// Guards the sweep queues and the buddy free lists
+	pthread_mutex_t sweepmutex;
+	pthread_cond_t sweepstart;
+	pthread_cond_t sweepdone;
+	unsigned sweepround; // Guarded by sweepmutex
+	bool sweeping;       // Guarded by sweepmutex; an arena is in hand
+
+	bool sweeperstarted;
+	pthread_t sweeper;
+
+	arena_t *largearenas;
+
+	// Frozen by mem_freeze() or mapped from a heap image
+	arena_t *immortalarenas;
+	arena_t **immortallarge; // Sorted, for is_immortal()
+	size_t maximmortallarge, nimmortallarge;
+	int64_t immortalsize;
+
+	immortal_ref_t *immortalrefs; // Open addressing on p
+	size_t immortalrefcap, nimmortalrefs;
+
+	struct arena_space arenaspaces[MAX_ARENA_SPACES];
+	int narenaspaces;
+
+	arena_t *sweptempty;     // Found empty by a sweep; guarded by sweepmutex
+	arena_t *emptyarenas;    // Kept around for reuse
+	arena_t *releasedarenas; // Still mapped, but handed back to the OS
+	unsigned gcreleased;     // Arenas released since the last cycle
+
+	bool gccompacting; // Whether this cycle is recording slots to fix up
+
+	arena_t **evacuees; // Sorted, for forward()
+	size_t nevacuees;
+
+	void **evacslots; // Slots that pointed into an evacuating arena
+	size_t maxevacslots, nevacslots;
+
+	// Bump-pointer allocation space for cells; it only ever holds cell_t's
+	char *nursery, *nurserytop, *nurseryend;
+	uint8_t nurserymarks[NURSERY_SIZE/sizeof(cell_t)/8]; // Full cycles
+
+	void **remembered; // Old slots that may point into the nursery
+	size_t maxremembered, nremembered;
+
+	cell_t **promoted; // Survivors whose children are still young
+	size_t maxpromoted, npromoted;
+
+	int64_t heapsize;   // Total of all arenas
+	int64_t heapallocd; // Total of all allocs - frees
+	int64_t heapused;   // Updated each mem_gc()
+
+	int64_t gctrigger; // heapallocd that starts a cycle
+	bool gcforced;     // Finish a whole cycle right away
+
+	bool gcinvert;  // Swaps the meaning of white and black GC bits
+	bool gcmarking; // Whether a cycle is between safepoints
+
+	gray_t *grays; // Marked, but with children still to be scanned
+	size_t maxgrays, ngrays;
+
+	marker_t *markers;
+
+	pthread_mutex_t markmutex;
+	pthread_cond_t markstart;
+	pthread_cond_t markdone;
+	unsigned markround, nmarking; // Guarded by markmutex
+
+	_Atomic unsigned nidle;     // Markers out of work
+	_Atomic int64_t markbudget; // Objects left to scan in this drain
+
+	int64_t oldheapsize, oldheapallocd; // At the start of a cycle
+	int64_t gcscanned;                  // Objects scanned this cycle
+	double gcmarktime;                  // Seconds spent marking
+	double gcmaxpause;                  // Longest marking step
 
-static arena_t *buddyarenas;
-static bi_free_block_t buddyfree[BUDDY_MAX_EXP];
+	// Lifetime totals for mem_get_stats(); sweeping happens on either thread
+	uint64_t gccycles, gcminors;
+	double gctotalmarktime;
+	_Atomic int64_t gcsweepns;
+	_Atomic int64_t gcreclaimed[3]; // By arena type
+	uint64_t gcpauses[MEM_PAUSE_BUCKETS], gcnpauses;
+	double gctotalmaxpause;
+	uint64_t gcpruned; // Entries dropped from weak hashtables
 
-static arena_t *largearenas;
+	// Requested sizes of mem_alloc()s, exact and then by powers of two
+	struct {
+		uint64_t count;
+		uint64_t requested, granted; // Bytes
+	} sizecounts[SIZE_HIST_EXACT + 1 + 64];
+
+	// Where each object came from, for the census; only while enabled
+	alloc_site_t *allocsites; // The first stands for unknown
+	uint32_t maxallocsites, nallocsites, lastallocsite;
+	uint32_t *allocsitetab; // Open addressing on the site; index
+	size_t allocsitetabcap;
+	ptr_map_t allocsitesof; // Site index by object
+} heap_t;
+
+// The running interpreter's heap, or the one a helper thread works for
+static _Thread_local heap_t *heap;
+
+static _Thread_local marker_t *curmarker; // Set only during parallel drains
+
+_Thread_local const char *allocsite = "init";
+_Thread_local const char *allocfile = "-";
+_Thread_local uint32_t allocline;
+
+static size_t hash_ptr(void *p) {
+	return (uint64_t) (uintptr_t) p*0x9e3779b97f4a7c15ull >> 17;
+}
+
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Files one safepoint's worth of collector work in the pause histogram
+static void note_pause(double pause) {
+	int i;
+
+	for(i = 0; i < MEM_PAUSE_BUCKETS - 1 && pause >= (2 << i)/1e6; i++);
+
+	heap->gcpauses[i]++;
+	heap->gcnpauses++;
+	heap->gctotalmaxpause = fmax(heap->gctotalmaxpause,pause);
+}
+
+// Adds up what sweeping one arena freed and how long it took
+static void note_sweep(int type, int64_t freed, double start) {
+	atomic_fetch_add_explicit(&heap->gcreclaimed[type],freed,
+		memory_order_relaxed);
+	atomic_fetch_add_explicit(&heap->gcsweepns,(int64_t) (1e9*(now() - start)),
+		memory_order_relaxed);
+}
+
+#if MESSAGE_LEVEL >= 2
+// Resident set size in bytes, or -1 if the system will not say
+static long long resident() {
+	FILE *f;
+	long long pages;
+
+	if(!(f = fopen("/proc/self/statm","r")))
+		return -1;
+
+	if(fscanf(f,"%*s %lld",&pages) != 1)
+		pages = -1;
+
+	fclose(f);
+
+	return pages < 0 ? -1 : pages*sysconf(_SC_PAGESIZE);
+}
+#endif
+
+// Asks for transparent huge pages over an arena space; only advice
+static void advise_huge_pages(struct arena_space *space) {
+#ifdef MADV_HUGEPAGE
+	if(madvise(space->base,space->end - space->base,MADV_HUGEPAGE))
+		error("cannot use huge pages for the heap");
+#endif
+}
+
+// Hands out n contiguous, aligned arenas' worth of address space, reserving
+// more if no space has that much left; pages are only backed once touched
+static char *carve_arenas(size_t n) {
+	char *base, *p;
+	size_t size, trail;
+	struct arena_space *space;
+
+	// Whichever space has room, so the tail of one that fell short of an
+	// earlier request, or that an image was mapped after, still gets used
+	space = NULL;
+	for(int i = 0; i < heap->narenaspaces && !space; i++)
+		if((size_t) (heap->arenaspaces[i].end - heap->arenaspaces[i].top)
+			>= n*ARENA_SIZE)
+			space = heap->arenaspaces + i;
+
+	if(!space) {
+		if(heap->narenaspaces == MAX_ARENA_SPACES)
+			die("out of address space for the heap");
+
+		// Settle for less if the system will not give us that much
+		for(size = GC_ARENA_SPACE; ; size /= 2) {
+			if(size < n*ARENA_SIZE)
+				die("cannot reserve %lli bytes",(long long) n*ARENA_SIZE);
+
+			base = mmap(NULL,size + ARENA_SIZE,PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,-1,0);
+			if(base != MAP_FAILED)
+				break;
+		}
+
+		// Trim it down to something aligned
+		p = (char *) (((uintptr_t) base + ARENA_SIZE - 1)&~(ARENA_SIZE - 1));
+		trail = base + ARENA_SIZE - p;
+		if(p > base)
+			munmap(base,p - base);
+		if(trail)
+			munmap(p + size,trail);
+
+		space = heap->arenaspaces + heap->narenaspaces++;
+		space->base = space->top = p;
+		space->end = p + size;
+
+		if(hugepages)
+			advise_huge_pages(space);
+
+		debug("new arena space:"
+		    "\n\tbase address: %p"
+		    "\n\ttotal size:   %lli",
+			space->base,(long long) size);
+	}
+
+	p = space->top;
+	space->top += n*ARENA_SIZE;
+
+	return p;
+}
+
+static inline bool in_arena_space(void *p) {
+	for(int i = 0; i < heap->narenaspaces; i++) {
+		if((uintptr_t) p - (uintptr_t) heap->arenaspaces[i].base
+			< (uintptr_t) (heap->arenaspaces[i].end
+			- heap->arenaspaces[i].base))
+			return true;
+	}
+
+	return false;
+}
+
+// The arena header for an old object
+static inline arena_t *arena_of(void *p) {
+	if(in_arena_space(p))
+		return (arena_t *) ((uintptr_t) p&~(ARENA_SIZE - 1));
+
+	return (arena_t *) ((char *) p - LARGE_HEADSIZE);
+}
+
+// Whether p is anywhere inside an immortal object, even partway into one
+static bool is_immortal(void *p) {
+	size_t lo, hi, mid;
+
+	if(IS_YOUNG(p))
+		return false;
+
+	if(in_arena_space(p))
+		return ((arena_t *) ((uintptr_t) p&~(ARENA_SIZE - 1)))->flags
+			&ARENA_IMMORTAL;
+
+	// Otherwise it could only be in a large object
+	lo = 0;
+	hi = heap->nimmortallarge;
+	while(lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if((char *) heap->immortallarge[mid] <= (char *) p)
+			lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo && (char *) p < heap->immortallarge[lo - 1]->blocks
+		+ heap->immortallarge[lo - 1]->size;
+}
+
+static bool clean_fixed_arena(arena_t **);
+static bool clean_buddy_arena(arena_t **);
+
+// Keeps an empty arena for reuse, unless the heap has outgrown the headroom
+// policy, in which case its pages go back to the OS
+static void pool_empty_arena(arena_t *arena) {
+	if(heap->heapsize > fmax(gcminheap,GC_HEADROOM*heap->heapused)
+		|| gclimit && heap->heapsize > gclimit) {
+		madvise(arena,ARENA_SIZE,MADV_DONTNEED);
+		heap->heapsize -= ARENA_SIZE;
+		heap->gcreleased++;
+
+		arena->next = heap->releasedarenas;
+		heap->releasedarenas = arena;
+	} else {
+		arena->next = heap->emptyarenas;
+		heap->emptyarenas = arena;
+	}
+}
+
+// Takes in whatever the sweeps have emptied
+static void reclaim_empty_arenas() {
+	arena_t *arena, *next;
 
-static int64_t heapsize = 0;      // Total of all arenas
-static int64_t heapallocd = 0;    // Total of all allocs - frees
-static int64_t heapused = 100000; // Updated each mem_gc()
+	pthread_mutex_lock(&heap->sweepmutex);
+	arena = heap->sweptempty;
+	heap->sweptempty = NULL;
+	pthread_mutex_unlock(&heap->sweepmutex);
 
-static bool gcinvert = true; // Swaps the meaning of white and black GC bits
+	for(; arena; arena = next) {
+		next = arena->next;
+		pool_empty_arena(arena);
+	}
+}
 
+// Must not be called with sweepmutex held
 static arena_t *alloc_arena() {
-	heapsize += ARENA_SIZE;
-	return aligned_alloc(ARENA_SIZE,ARENA_SIZE);
+	arena_t *arena;
+
+	reclaim_empty_arenas();
+
+	if(arena = heap->emptyarenas) {
+		heap->emptyarenas = arena->next;
+		return arena;
+	}
+
+	heap->heapsize += ARENA_SIZE;
+
+	// Released pages come back zeroed as they are touched
+	if(arena = heap->releasedarenas) {
+		heap->releasedarenas = arena->next;
+		return arena;
+	}
+
+	return (arena_t *) carve_arenas(1);
+}
+
+// Hands over an arena of the ith size class that has been swept, sweeping
+// one here if the sweeper has not got to it yet; NULL if none are left
+static arena_t *fixed_next_swept(int i) {
+	arena_t *arena, **list, *unswept;
+
+	do {
+		unswept = NULL;
+
+		pthread_mutex_lock(&heap->sweepmutex);
+		if(arena = heap->fixedarenas[i].swept)
+			heap->fixedarenas[i].swept = arena->next;
+		else if(unswept = heap->fixedarenas[i].unswept)
+			heap->fixedarenas[i].unswept = unswept->next;
+		pthread_mutex_unlock(&heap->sweepmutex);
+
+		if(arena)
+			break;
+
+		if(!unswept)
+			return NULL;
+
+		// An empty arena can go to any size class
+		if(clean_fixed_arena(&unswept))
+			pool_empty_arena(unswept);
+		else arena = unswept;
+	} while(!arena);
+
+	list = arena->freelist ? &heap->fixedarenas[i].arenas
+		: &heap->fixedarenas[i].full;
+	arena->next = *list;
+	*list = arena;
+
+	return arena;
 }
 
-static void *fixed_alloc(arena_t **arenas, size_t size) {
+static void *fixed_alloc(int sizeclass) {
 	void *p;
 	int gcbitsi;
-	arena_t *arena;
+	size_t size;
 	uint8_t *flagsp;
-	size_t align, blocksoff, nblocks;
+	arena_t *arena, **arenas;
+	size_t blocksoff, nblocks;
+
+	arenas = &heap->fixedarenas[sizeclass].arenas;
+	size = heap->fixedarenas[sizeclass].size;
 
-	assert(size != 0 && !(size & size - 1));
-	assert(size >= sizeof(free_block_t));
+	assert(size != 0 && size%sizeof(free_block_t) == 0);
 
-	// Search the existing fixed-sized arenas first
-	for(arena = *arenas; arena && !arena->freelist; arena = arena->next);
+	// Every arena on the list has room; only sweep more once it runs dry
+	if(!(arena = *arenas))
+		while((arena = fixed_next_swept(sizeclass)) && !arena->freelist);
 
 	// Did we find one?
 	if(arena) {
 		p = arena->freelist;
 
 		// Set the flags
-		gcbitsi = GC_NUM_BITS*((char *) p - arena->blocks)/arena->size;
+		gcbitsi = GC_NUM_BITS
+			*(((char *) p - arena->blocks)/arena->size);
 		flagsp = (uint8_t *) arena->data + gcbitsi/8;
 		*flagsp = *flagsp&~FIXED_GC_MASK(gcbitsi%8)
 			| FIXED_GC_BLACK(gcbitsi%8);
@@ -163,7 +719,14 @@ static void *fixed_alloc(arena_t **arenas, size_t size) {
 			}
 		} else arena->freelist = arena->freelist->next;
 
-		heapallocd += arena->size;
+		// Keep only arenas with room on the list
+		if(!arena->freelist) {
+			*arenas = arena->next;
+			arena->next = heap->fixedarenas[sizeclass].full;
+			heap->fixedarenas[sizeclass].full = arena;
+		}
+
+		heap->heapallocd += arena->size;
 
 		return p;
 	}
@@ -174,13 +737,13 @@ static void *fixed_alloc(arena_t **arenas, size_t size) {
 	arena->size = size;
 	arena->flags = ARENA_FIXED | ARENA_NEW;
 
-	if(size < alignof(max_align_t))
-		align = size;
-	else align = alignof(max_align_t);
-
+	// Blocks end flush with the arena, so sizes that are not powers of two
+	// are only as aligned as their lowest set bit
 	nblocks = (ARENA_SIZE - offsetof(arena_t,data))/(size + (float) 2/8);
-	blocksoff = (offsetof(arena_t,data) + (nblocks*2 + 7)/8 + align - 1)
-		&~(align - 1);
+	while(offsetof(arena_t,data) + (nblocks*2 + 7)/8
+		> ARENA_SIZE - nblocks*size)
+		nblocks--;
+	blocksoff = ARENA_SIZE - nblocks*size;
 
 	arena->blocks = (char *) arena + blocksoff;
 
@@ -205,7 +768,7 @@ static void *fixed_alloc(arena_t **arenas, size_t size) {
 	flagsp = (uint8_t *) arena->data;
 	*flagsp = *flagsp&~FIXED_GC_MASK(0) | FIXED_GC_BLACK(0);
 
-	heapallocd += arena->size;
+	heap->heapallocd += arena->size;
 
 	return arena->blocks;
 }
@@ -213,11 +776,11 @@ static void *fixed_alloc(arena_t **arenas, size_t size) {
 static void buddy_add_free_block(void *block, int sizeexp) {
 	bi_free_block_t *_block = block;
 
-	if(_block->next = buddyfree[sizeexp].next)
+	if(_block->next = heap->buddyfree[sizeexp].next)
 		_block->next->prev = _block;
 
-	_block->prev = buddyfree + sizeexp;
-	buddyfree[sizeexp].next = _block;
+	_block->prev = heap->buddyfree + sizeexp;
+	heap->buddyfree[sizeexp].next = _block;
 }
 
 static void buddy_claim_free_block(void *block) {
@@ -242,33 +805,78 @@ static void buddy_split_block(arena_t *arena, void *block, int sizeexp) {
 		| sizeexp - 1 - BUDDY_MIN_EXP;
 }
 
+// The start of the block p points into. Blocks are aligned to their size, and
+// any aligned address before p's block starts a smaller block of its own, so
+// only the real start claims the size it is aligned to.
+static char *buddy_block_of(arena_t *arena, void *p) {
+	char *block;
+
+	for(int sizeexp = BUDDY_MAX_EXP - 1; sizeexp > BUDDY_MIN_EXP;
+		sizeexp--) {
+		block = (char *) ((uintptr_t) p&~(((uintptr_t) 1 << sizeexp) - 1));
+
+		if(block >= arena->blocks && BUDDY_MIN_EXP
+			+ (*BUDDY_FLAGSP(arena,block)&BUDDY_SIZE_MASK) == sizeexp)
+			return block;
+	}
+
+	return (char *) ((uintptr_t) p&~(uintptr_t) (BUDDY_MIN_ALLOC - 1));
+}
+
+// Returns whether there was anything left to sweep; needs sweepmutex held
+static bool buddy_sweep_next() {
+	arena_t *arena;
+
+	if(!heap->buddyunswept)
+		return false;
+
+	// Do not hold on to a link in an arena that might be evacuated
+	if(!(arena = *heap->buddyunswept)) {
+		heap->buddyunswept = NULL;
+		return false;
+	}
+
+	if(clean_buddy_arena(&arena)) {
+		*heap->buddyunswept = arena->next;
+		arena->next = heap->sweptempty;
+		heap->sweptempty = arena;
+	} else heap->buddyunswept = &arena->next;
+
+	return true;
+}
+
 static void *buddy_check_free_lists(int sizeexp) {
 	arena_t *arena;
 	bi_free_block_t *block;
 
-	for(int i = sizeexp; i < BUDDY_MAX_EXP; i++) {
-		// Do we have a free one?
-		if(block = buddyfree[i].next) {
-			// In what arena?
-			arena = (arena_t *)
-				((uintptr_t) block&~(ARENA_SIZE - 1));
+	do {
+		for(int i = sizeexp; i < BUDDY_MAX_EXP; i++) {
+			// Do we have a free one?
+			if(block = heap->buddyfree[i].next) {
+				// In what arena?
+				arena = (arena_t *)
+					((uintptr_t) block&~(ARENA_SIZE - 1));
 
-			// Claim it
-			buddy_claim_free_block(block);
+				// Claim it
+				buddy_claim_free_block(block);
 
-			// Split it, as needed
-			while(i > sizeexp)
-				buddy_split_block(arena,block,i--);
+				// Split it, as needed
+				while(i > sizeexp)
+					buddy_split_block(arena,block,i--);
 
-			// Mark it as taken
-			*BUDDY_FLAGSP(arena,block) = BUDDY_GC_BLACK
-				| i - BUDDY_MIN_EXP;
+				// Mark it as taken
+				*BUDDY_FLAGSP(arena,block) = BUDDY_GC_BLACK
+					| i - BUDDY_MIN_EXP;
 
-			heapallocd += 1 << sizeexp;
+				arena->size += 1 << sizeexp;
+				heap->heapallocd += 1 << sizeexp;
 
-			return block;
+				return block;
+			}
 		}
-	}
+
+		// Nothing free, so sweep another arena and try again
+	} while(buddy_sweep_next());
 
 	return NULL;
 }
@@ -291,13 +899,19 @@ static void *buddy_alloc(arena_t **arenas, size_t size) {
 	if(size >= 1  <<  1) sizei +=  1, size >>=  1;
 	assert(sizei < BUDDY_MAX_EXP);
 
+	pthread_mutex_lock(&heap->sweepmutex);
+
 	// Check the free lists
-	if(block = buddy_check_free_lists(sizei))
+	block = buddy_check_free_lists(sizei);
+
+	pthread_mutex_unlock(&heap->sweepmutex);
+
+	if(block)
 		return block;
 
 	// We need a new arena
 	arena = alloc_arena();
-	arena->next = *arenas;
+	arena->size = 0;
 	arena->flags = ARENA_BUDDY;
 
 	nblocks = (ARENA_SIZE - offsetof(arena_t,data))
@@ -317,56 +931,285 @@ static void *buddy_alloc(arena_t **arenas, size_t size) {
 		arena,(int) ARENA_SIZE,(int) BUDDY_MIN_ALLOC,(int) nblocks,
 		(int) headsize,100.*headsize/ARENA_SIZE);
 
+	pthread_mutex_lock(&heap->sweepmutex);
+
 	// Split up the new arena for the header
 	for(int i = BUDDY_MAX_EXP - 1; (size_t) 1 << i >= headsize; i--)
 		buddy_split_block(arena,arena,i + 1);
 
+	arena->next = *arenas;
 	*arenas = arena;
 
 	// Now we definitely have room
-	return buddy_check_free_lists(sizei);
+	block = buddy_check_free_lists(sizei);
+
+	pthread_mutex_unlock(&heap->sweepmutex);
+
+	return block;
+}
+
+// Bytes of pages that hold a large object of the given size
+static size_t large_map_size(size_t size) {
+	size_t pagesize;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+
+	return (LARGE_HEADSIZE + size + pagesize - 1)&~(pagesize - 1);
 }
 
 static void *large_alloc(size_t size) {
 	arena_t *arena;
-	size_t align, headsize;
+	size_t mapsize;
 
-	align = alignof(max_align_t);
-	headsize = (offsetof(arena_t,data) + align - 1)&~(align - 1);
+	mapsize = large_map_size(size);
 
-	if(posix_memalign((void **) &arena,ARENA_SIZE,size + headsize))
+	arena = mmap(NULL,mapsize,PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+	if(arena == MAP_FAILED)
 		die("cannot allocate %lli bytes",(long long) size);
+
 	arena->size = size;
-	arena->flags = ARENA_LARGE | ARENA_GC_WHITE;
-	arena->blocks = (char *) arena + headsize;
+	arena->flags = ARENA_LARGE | ARENA_GC_BLACK;
+	arena->blocks = (char *) arena + LARGE_HEADSIZE;
+
+	arena->next = heap->largearenas;
+	heap->largearenas = arena;
+
+	heap->heapsize += mapsize;
+	heap->heapallocd += size;
 
-	heapsize += headsize + size;
-	heapallocd += size;
+	return arena->blocks;
+}
+
+// Which fixed arenas an allocation of at most FIXED_MAX_SIZE goes in
+static void init_fixed_classes() {
+	int i, j;
+
+	for(i = j = 0; i <= FIXED_MAX_SIZE/8; i++) {
+		while(fixedsizes[j] < (size_t) 8*i)
+			j++;
+		fixedclasses[i] = j;
+	}
 
-	return (void *) ((uintptr_t) (arena->data + align - 1)&~(align - 1));
+	assert(fixedsizes[j] == FIXED_MAX_SIZE);
 }
 
-void *mem_alloc(size_t size) {
+static int fixed_class(size_t size) {
+	return fixedclasses[(size + 7)/8];
+}
+
+// The bytes an allocation of the given size actually takes up
+static size_t granted_size(size_t size) {
+	size_t block;
+
+	if(size <= FIXED_MAX_SIZE)
+		return heap->fixedarenas[fixed_class(size)].size;
+
+	if(size < BUDDY_MAX_ALLOC) {
+		for(block = BUDDY_MIN_ALLOC; block < size; block *= 2);
+		return block;
+	}
+
+	return large_map_size(size);
+}
+
+static void note_alloc_size(size_t size) {
 	int i;
 
+	// Past the exact range, bucket SIZE_HIST_EXACT + 1 + i holds sizes up
+	// to 2^i
+	if(size <= SIZE_HIST_EXACT)
+		i = size;
+	else {
+		for(i = 0; (size - 1) >> i; i++);
+		i += SIZE_HIST_EXACT + 1;
+	}
+
+	heap->sizecounts[i].count++;
+	heap->sizecounts[i].requested += size;
+	heap->sizecounts[i].granted += granted_size(size);
+}
+
+// Finds p's slot, adding one for it if there is none and add is set
+static struct ptr_map_slot *ptr_map_find(ptr_map_t *map, void *p, bool add) {
+	size_t i, oldcap;
+	struct ptr_map_slot *old;
+
+	if(add && 2*(map->n + 1) > map->cap) {
+		old = map->slots;
+		oldcap = map->cap;
+
+		map->cap = oldcap ? 2*oldcap : 1 << 10;
+		map->slots = calloc(map->cap,sizeof *map->slots);
+		assert(map->slots);
+
+		for(size_t j = 0; j < oldcap; j++) {
+			if(!old[j].p)
+				continue;
+
+			i = hash_ptr(old[j].p)&(map->cap - 1);
+			while(map->slots[i].p)
+				i = (i + 1)&(map->cap - 1);
+			map->slots[i] = old[j];
+		}
+
+		free(old);
+	}
+
+	if(!map->cap)
+		return NULL;
+
+	for(i = hash_ptr(p)&(map->cap - 1); map->slots[i].p;
+		i = (i + 1)&(map->cap - 1))
+		if(map->slots[i].p == p)
+			return map->slots + i;
+
+	if(!add)
+		return NULL;
+
+	map->slots[i] = (struct ptr_map_slot) {p,0};
+	map->n++;
+
+	return map->slots + i;
+}
+
+static void ptr_map_free(ptr_map_t *map) {
+	free(map->slots);
+	*map = (ptr_map_t) {NULL,0,0};
+}
+
+static size_t hash_site(const char *name, const char *file, uint32_t line) {
+	return hash_ptr((void *) ((uintptr_t) name ^ 31*(uintptr_t) file
+		^ (uintptr_t) line << 32));
+}
+
+// The index of the site allocating right now, adding it if it is new
+static uint32_t current_alloc_site() {
+	size_t i;
+	alloc_site_t *site;
+
+	// Consecutive allocations mostly come from the same place
+	site = heap->allocsites + heap->lastallocsite;
+	if(heap->lastallocsite && site->name == allocsite
+		&& site->file == allocfile && site->line == allocline)
+		return heap->lastallocsite;
+
+	if(2*heap->nallocsites >= heap->allocsitetabcap) {
+		free(heap->allocsitetab);
+		heap->allocsitetabcap = heap->allocsitetabcap
+			? 2*heap->allocsitetabcap : 1 << 8;
+		heap->allocsitetab = calloc(heap->allocsitetabcap,
+			sizeof *heap->allocsitetab);
+		assert(heap->allocsitetab);
+
+		for(uint32_t j = 1; j < heap->nallocsites; j++) {
+			site = heap->allocsites + j;
+			i = hash_site(site->name,site->file,site->line)
+				&(heap->allocsitetabcap - 1);
+			while(heap->allocsitetab[i])
+				i = (i + 1)&(heap->allocsitetabcap - 1);
+			heap->allocsitetab[i] = j;
+		}
+	}
+
+	for(i = hash_site(allocsite,allocfile,allocline)
+		&(heap->allocsitetabcap - 1); heap->allocsitetab[i];
+		i = (i + 1)&(heap->allocsitetabcap - 1)) {
+		site = heap->allocsites + heap->allocsitetab[i];
+		if(site->name == allocsite && site->file == allocfile
+			&& site->line == allocline)
+			return heap->lastallocsite = heap->allocsitetab[i];
+	}
+
+	if(heap->nallocsites >= heap->maxallocsites) {
+		heap->maxallocsites = 2*heap->maxallocsites;
+		heap->allocsites = realloc(heap->allocsites,
+			heap->maxallocsites*sizeof *heap->allocsites);
+		assert(heap->allocsites);
+	}
+
+	heap->allocsites[heap->nallocsites] = (alloc_site_t) {allocsite,allocfile,
+		allocline};
+	heap->allocsitetab[i] = heap->nallocsites;
+
+	return heap->lastallocsite = heap->nallocsites++;
+}
+
+static void note_alloc_site(void *p) {
+	ptr_map_find(&heap->allocsitesof,p,true)->val = current_alloc_site();
+}
+
+// Moved objects keep the site they were allocated at
+static void move_alloc_site(void *from, void *to) {
+	struct ptr_map_slot *slot;
+	uint32_t site;
+
+	if(!(slot = ptr_map_find(&heap->allocsitesof,from,false)))
+		return;
+
+	site = slot->val;
+	ptr_map_find(&heap->allocsitesof,to,true)->val = site;
+}
+
+void *mem_alloc(size_t size) {
+	void *p;
+
+	if(sizehist)
+		note_alloc_size(size);
+
 	// Small objects have their own arenas
-	for(i = 0; fixedarenas[i].size; i++)
-		if(size <= fixedarenas[i].size)
-			return fixed_alloc(&fixedarenas[i].arenas,
-				fixedarenas[i].size);
+	if(size <= FIXED_MAX_SIZE)
+		p = fixed_alloc(fixed_class(size));
 
 	// Medium objects use the buddy system
-	if(size < BUDDY_MAX_ALLOC)
-		return buddy_alloc(&buddyarenas,size);
+	else if(size < BUDDY_MAX_ALLOC)
+		p = buddy_alloc(&heap->buddyarenas,size);
 
 	// Large objects get their own arenas
-	return large_alloc(size);
+	else p = large_alloc(size);
+
+	if(censussites)
+		note_alloc_site(p);
+
+	return p;
 }
 
 void *mem_dup(void *p, size_t n) {
 	return memcpy(mem_alloc(n),p,n);
 }
 
+void *mem_alloc_cell() {
+	void *p;
+
+	// Bump allocation in the nursery
+	if(heap->nurseryend - heap->nurserytop >= (ptrdiff_t) sizeof(cell_t)) {
+		p = heap->nurserytop;
+		heap->nurserytop += sizeof(cell_t);
+
+		if(censussites)
+			note_alloc_site(p);
+
+		return p;
+	}
+
+	// The nursery only gets emptied at a safepoint, so spill over for now
+	if(heap->nursery)
+		return mem_alloc(sizeof(cell_t));
+
+	heap->nursery = heap->nurserytop = carve_arenas((NURSERY_SIZE
+		+ ARENA_SIZE - 1)/ARENA_SIZE);
+	heap->nurseryend = heap->nursery + NURSERY_SIZE;
+
+	heap->heapsize += NURSERY_SIZE;
+
+	debug("new nursery:"
+	    "\n\tbase address: %p"
+	    "\n\ttotal size:   %i",
+		heap->nursery,(int) NURSERY_SIZE);
+
+	return mem_alloc_cell();
+}
+
 #define QUAL_v
 #define QUAL_pv   *
 #define QUAL_vpv  *
@@ -385,7 +1228,7 @@ void *mem_dup(void *p, size_t n) {
 
 #define HANDLE_STACK_FRAME(all, fcn) \
 case PREFIX_BUILTIN(,fcn): \
-	DEFER(EACH_INDIRECT)()(MARK_VAR_FROM_DATA,(;),,PRESERVE_##fcn); \
+	DEFER(EACH_INDIRECT)()(all,(;),,PRESERVE_##fcn); \
 	break
 
 #define MARK_TYPE(t, sq) MARK_TYPE_(t, sq)
@@ -422,35 +1265,79 @@ static const mark_func_t markfuncs[] = {
 	EACH(REGISTER_MARK_FUNC,(,),(),GC_TYPES)
 };
 
-static void MARK_TYPE(lambda_t,)(lambda_t x) {
-	MARK_TYPE(env_t,p)(x.env);
-	MARK_TYPE(cell_t,p)(x.args);
-	MARK_TYPE(cell_t,p)(x.body);
-}
+#define CASE_GC_TYPE_INDIRECT(all, type) case GC_TYPE_INDIRECT(type):
+
+// Whether a root of this type points at a pointer rather than an object
+static bool is_indirect(gc_type_t type) {
+	switch(type) {
+	EACH(CASE_GC_TYPE_INDIRECT,(),(),GC_TYPES)
+		return true;
+
+	default: return false;
+	}
+}
+
+// Blackens a flag byte; parallel markers race for it, so only one wins
+static bool mark_bits(uint8_t *flagsp, uint8_t mask, uint8_t black) {
+	bool marked;
+
+	if(!curmarker) {
+		marked = (*flagsp&mask) == black;
+		*flagsp = *flagsp&~mask | black;
+
+		return marked;
+	}
+
+	if(atomic_fetch_or_explicit((_Atomic uint8_t *) flagsp,black,
+		memory_order_relaxed)&black)
+		return true;
+
+	// The winner clears white; the black bit alone now reads as marked
+	atomic_fetch_and_explicit((_Atomic uint8_t *) flagsp,~mask | black,
+		memory_order_relaxed);
+
+	return false;
+}
 
 // Returns whether p was already marked
 static bool mark_ptr(void *p) {
 	int gcbitsi;
 	bool marked;
 	size_t size;
+	uint32_t flags;
 	arena_t *arena;
 	uint8_t *flagsp;
 
-	// Sanity check
-	if(!p) return true;
+	// Nothing behind nil or an immediate
+	if(!p || CELL_IS_IMMEDIATE(p)) return true;
 
-	arena = (arena_t *) ((uintptr_t) p&~(ARENA_SIZE - 1));
+	// Young cells are traced in place and evacuated afterwards
+	if(IS_YOUNG(p)) {
+		gcbitsi = ((char *) p - heap->nursery)/sizeof(cell_t);
+
+		return mark_bits(heap->nurserymarks + gcbitsi/8,1 << gcbitsi%8,
+			1 << gcbitsi%8);
+	}
+
+	arena = arena_of(p);
+
+	// Markers might be pinning it meanwhile
+	flags = atomic_load_explicit((_Atomic uint32_t *) &arena->flags,
+		memory_order_relaxed);
+
+	// Immortal objects count as black, and are never scanned
+	if(flags&ARENA_IMMORTAL)
+		return true;
 
 	// What kind of arena?
-	switch(arena->flags&ARENA_TYPE_MASK) {
+	switch(flags&ARENA_TYPE_MASK) {
 	case ARENA_FIXED:
 		// Fixed GC bits are all packed together
-		gcbitsi = GC_NUM_BITS*((char *) p - arena->blocks)/arena->size;
+		gcbitsi = GC_NUM_BITS
+			*(((char *) p - arena->blocks)/arena->size);
 		flagsp = (uint8_t *) arena->data + gcbitsi/8;
-		marked = FIXED_GC_COLOR(*flagsp,gcbitsi%8)
-			== FIXED_GC_BLACK(gcbitsi%8);
-		*flagsp = *flagsp&~FIXED_GC_MASK(gcbitsi%8)
-			| FIXED_GC_BLACK(gcbitsi%8);
+		marked = mark_bits(flagsp,FIXED_GC_MASK(gcbitsi%8),
+			FIXED_GC_BLACK(gcbitsi%8));
 
 		size = arena->size;
 		break;
@@ -458,16 +1345,29 @@ static bool mark_ptr(void *p) {
 	case ARENA_BUDDY:
 		// Each buddy block gets its own byte for flags
 		flagsp = BUDDY_FLAGSP(arena,p);
-		marked = BUDDY_GC_COLOR(*flagsp) == BUDDY_GC_BLACK;
-		*flagsp = *flagsp&~BUDDY_GC_MASK | BUDDY_GC_BLACK;
+		marked = mark_bits(flagsp,BUDDY_GC_MASK,BUDDY_GC_BLACK);
 
 		size = 1 << BUDDY_MIN_EXP + (*flagsp&BUDDY_SIZE_MASK);
 		break;
 
 	case ARENA_LARGE:
 		// Large arenas are individual allocations
-		marked = ARENA_GC_COLOR(arena->flags) == ARENA_GC_BLACK;
-		arena->flags = arena->flags&ARENA_GC_MASK | ARENA_GC_BLACK;
+		if(curmarker) {
+			marked = atomic_fetch_or_explicit(
+				(_Atomic uint32_t *) &arena->flags,
+				ARENA_GC_BLACK,memory_order_relaxed)
+				&ARENA_GC_BLACK;
+			if(!marked)
+				atomic_fetch_and_explicit(
+					(_Atomic uint32_t *) &arena->flags,
+					~ARENA_GC_MASK | ARENA_GC_BLACK,
+					memory_order_relaxed);
+		} else {
+			marked = ARENA_GC_COLOR(arena->flags)
+				== ARENA_GC_BLACK;
+			arena->flags = arena->flags&~ARENA_GC_MASK
+				| ARENA_GC_BLACK;
+		}
 
 		size = arena->size;
 		break;
@@ -476,294 +1376,3007 @@ static bool mark_ptr(void *p) {
 		arena->flags&ARENA_TYPE_MASK); break;
 	}
 
-	if(!marked)
-		heapallocd += size;
+	if(!marked) {
+		if(curmarker)
+			curmarker->allocd += size;
+		else heap->heapallocd += size;
+	}
 
 	return marked;
 }
 
-static void MARK_TYPE(string_t,p)(string_t *x) {
-	mark_ptr(x);
+// The large object p points somewhere into; there are few enough to search
+static arena_t *large_arena_of(void *p) {
+	for(arena_t *arena = heap->largearenas; arena; arena = arena->next)
+		if((char *) p >= arena->blocks
+			&& (char *) p < arena->blocks + arena->size)
+			return arena;
+
+	return arena_of(p);
 }
 
-static void MARK_TYPE(cell_t,p)(cell_t *x) {
-	if(mark_ptr(x))
-		return;
+// Whether the old object containing p has been marked this cycle
+static bool is_marked(void *p) {
+	int gcbitsi;
+	arena_t *arena;
+	uint8_t *flagsp;
 
-	switch(cell_type(x)) {
-	case VAL_SYM:
-		MARK_TYPE(string_t,p)(x->sym);
-		break;
+	if(in_arena_space(p))
+		arena = arena_of(p);
+	else if(is_immortal(p))
+		return true;
+	else arena = large_arena_of(p);
 
-	case VAL_STR:
-		MARK_TYPE(string_t,p)(x->str);
-		break;
+	// Immortal objects are never freed
+	if(arena->flags&ARENA_IMMORTAL)
+		return true;
 
-	case VAL_LBA:
-		MARK_TYPE(lambda_t,)(*cell_lba(x));
-		break;
+	switch(arena->flags&ARENA_TYPE_MASK) {
+	case ARENA_FIXED:
+		gcbitsi = GC_NUM_BITS
+			*(((char *) p - arena->blocks)/arena->size);
+		flagsp = (uint8_t *) arena->data + gcbitsi/8;
+		return FIXED_GC_COLOR(*flagsp,gcbitsi%8)
+			== FIXED_GC_BLACK(gcbitsi%8);
 
-	case VAL_LST:
-		MARK_TYPE(cell_t,p)(x->car);
-		MARK_TYPE(cell_t,p)(x->cdr);
-		break;
+	case ARENA_BUDDY:
+		flagsp = BUDDY_FLAGSP(arena,buddy_block_of(arena,p));
+		return BUDDY_GC_COLOR(*flagsp) == BUDDY_GC_BLACK;
 
-	default: break;
+	case ARENA_LARGE:
+		return ARENA_GC_COLOR(arena->flags) == ARENA_GC_BLACK;
+
+	default: die("unhandled arena type in is_marked(): 0x%08u",
+		arena->flags&ARENA_TYPE_MASK); break;
 	}
+
+	return true;
 }
 
-static void MARK_TYPE(env_t,p)(env_t *x) {
-	if(mark_ptr(x))
-		return;
+static gray_ring_t *ring_new(int64_t size, gray_ring_t *prev) {
+	gray_ring_t *ring;
 
-	MARK_TYPE(env_t,p)(x->parent);
-	MARK_TYPE(htable_t,p)(x->tab);
+	ring = malloc(sizeof *ring + size*sizeof *ring->slots);
+	assert(ring);
+
+	ring->prev = prev;
+	ring->size = size;
+
+	return ring;
 }
 
-static void MARK_TYPE(hentry_t,p)(hentry_t *x) {
-	for(; x; x = x->next) {
-		if(mark_ptr(x))
-			return;
+// Only the marker's own thread may push
+static void marker_push(marker_t *m, gc_type_t type, void *p) {
+	int64_t b, t;
+	gray_ring_t *ring, *bigger;
+
+	b = atomic_load_explicit(&m->bottom,memory_order_relaxed);
+	t = atomic_load_explicit(&m->top,memory_order_acquire);
+	ring = atomic_load_explicit(&m->ring,memory_order_relaxed);
+
+	if(b - t > ring->size - 1) {
+		bigger = ring_new(2*ring->size,ring);
+
+		for(int64_t i = t; i < b; i++) {
+			atomic_store_explicit(&bigger->slots[i%bigger->size].type,
+				atomic_load_explicit(&ring->slots[i%ring->size]
+					.type,memory_order_relaxed),
+				memory_order_relaxed);
+			atomic_store_explicit(&bigger->slots[i%bigger->size].p,
+				atomic_load_explicit(&ring->slots[i%ring->size]
+					.p,memory_order_relaxed),
+				memory_order_relaxed);
+		}
+
+		atomic_store_explicit(&m->ring,bigger,memory_order_release);
+		ring = bigger;
+	}
 
-		MARK_TYPE(void,p)(x->key);
+	atomic_store_explicit(&ring->slots[b%ring->size].type,type,
+		memory_order_relaxed);
+	atomic_store_explicit(&ring->slots[b%ring->size].p,p,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&m->bottom,b + 1,memory_order_relaxed);
+}
 
-		if(x->val.type != GC_TYPE(etc))
-			markfuncs[x->val.type](x->val.p);
+// Only the marker's own thread may take
+static bool marker_take(marker_t *m, gray_t *gray) {
+	bool won;
+	int64_t b, t;
+	gray_ring_t *ring;
+
+	b = atomic_load_explicit(&m->bottom,memory_order_relaxed) - 1;
+	ring = atomic_load_explicit(&m->ring,memory_order_relaxed);
+	atomic_store_explicit(&m->bottom,b,memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&m->top,memory_order_relaxed);
+
+	// Empty?
+	if(t > b) {
+		atomic_store_explicit(&m->bottom,b + 1,memory_order_relaxed);
+		return false;
 	}
+
+	gray->type = atomic_load_explicit(&ring->slots[b%ring->size].type,
+		memory_order_relaxed);
+	gray->p = atomic_load_explicit(&ring->slots[b%ring->size].p,
+		memory_order_relaxed);
+
+	if(t < b)
+		return true;
+
+	// The last one, so the thieves may be after it too
+	won = atomic_compare_exchange_strong_explicit(&m->top,&t,t + 1,
+		memory_order_seq_cst,memory_order_relaxed);
+	atomic_store_explicit(&m->bottom,b + 1,memory_order_relaxed);
+
+	return won;
 }
 
-static void MARK_TYPE(htable_t,p)(htable_t *x) {
-	if(mark_ptr(x))
-		return;
+static bool marker_steal(marker_t *m, gray_t *gray) {
+	int64_t b, t;
+	gray_ring_t *ring;
+
+	t = atomic_load_explicit(&m->top,memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&m->bottom,memory_order_acquire);
 
-	mark_ptr(x->entries);
+	if(t >= b)
+		return false;
 
-	for(uint32_t i = 0; i < x->cap; i++)
-		MARK_TYPE(hentry_t,p)(x->entries[i]);
+	ring = atomic_load_explicit(&m->ring,memory_order_acquire);
+	gray->type = atomic_load_explicit(&ring->slots[t%ring->size].type,
+		memory_order_relaxed);
+	gray->p = atomic_load_explicit(&ring->slots[t%ring->size].p,
+		memory_order_relaxed);
+
+	return atomic_compare_exchange_strong_explicit(&m->top,&t,t + 1,
+		memory_order_seq_cst,memory_order_relaxed);
 }
 
-static void MARK_TYPE(lambda_t,p)(lambda_t *x) {
-	if(mark_ptr(x))
+static void gray_push(gc_type_t type, void *p) {
+	if(curmarker) {
+		marker_push(curmarker,type,p);
+		PREFETCH(p);
 		return;
+	}
 
-	MARK_TYPE(lambda_t,)(*x);
+	if(heap->ngrays >= heap->maxgrays) {
+		heap->maxgrays = 1.5*(heap->maxgrays + 1);
+		heap->grays = realloc(heap->grays,heap->maxgrays*sizeof *heap->grays);
+		assert(heap->grays);
+	}
+
+	heap->grays[heap->ngrays].type = type;
+	heap->grays[heap->ngrays].p = p;
+	heap->ngrays++;
+
+	// It will be scanned soon enough
+	PREFETCH(p);
 }
 
-static void MARK_TYPE(void,p)(void *p) {
-	mark_ptr(p);
+// Whether p is in an arena being emptied this cycle
+static bool is_evacuating(void *p) {
+	arena_t *arena;
+
+	if(!heap->gccompacting || !p || CELL_IS_IMMEDIATE(p) || IS_YOUNG(p))
+		return false;
+
+	arena = arena_of(p);
+
+	return atomic_load_explicit((_Atomic uint32_t *) &arena->flags,
+		memory_order_relaxed)&ARENA_EVACUATE;
 }
 
-#define MARK_SHIM(all, var) MARK_SHIM_(all, var)
-#define MARK_SHIM_(t, q, v) MARK_SHIM__(t, q, SQUAL_##q, v)
-#define MARK_SHIM__(t, q, sq, v) MARK_SHIM___(t, q, sq, v)
-#define MARK_SHIM___(type, qual, squal, var) \
-static inline void mark_##var(type QUAL_##qual x) { \
-	MARK_TYPE(type,squal)(x); \
+// Keeps whatever p is in from being evacuated; for things known by address
+static void pin_ptr(void *p) {
+	arena_t *arena;
+
+	if(!is_evacuating(p))
+		return;
+
+	arena = arena_of(p);
+	atomic_fetch_or_explicit((_Atomic uint32_t *) &arena->flags,
+		ARENA_PINNED,memory_order_relaxed);
 }
 
-#define MARK_SHIMS(all, def) MARK_SHIMS_ def
-#define MARK_SHIMS_(type, qual, vars) \
-	DEFER(EACH_INDIRECT)()(MARK_SHIM,(),(type, qual),LITERAL vars)
+// Remembers a slot to fix up if what it points to gets moved
+static void record_slot(void *slot) {
+	void *p;
+	void ***slots;
+	size_t *maxslots, *nslots;
 
-EXPAND(EACH(MARK_SHIMS,(),(),EVAL_VARS))
+	memcpy(&p,slot,sizeof p);
 
-static void clean_fixed_arena(arena_t **arena) {
-	char *flagsp;
-	long gcbitsi, nblocks;
-	free_block_t *freeblock, **freelist;
+	if(!is_evacuating(p))
+		return;
 
-	// How many blocks to check, and where to put newly freed blocks
-	if((*arena)->flags&ARENA_NEW) {
-		nblocks = ((char *) (*arena)->freelist - (*arena)->blocks)
-			/(*arena)->size;
-		freelist = &((free_block_t *) ((uintptr_t) *arena + ARENA_SIZE
-			- (*arena)->size))->next;
+	if(curmarker) {
+		slots = &curmarker->slots;
+		maxslots = &curmarker->maxslots;
+		nslots = &curmarker->nslots;
 	} else {
-		nblocks = ((char *) *arena + ARENA_SIZE - (*arena)->blocks)
-			/(*arena)->size;
-		freelist = &(*arena)->freelist;
+		slots = &heap->evacslots;
+		maxslots = &heap->maxevacslots;
+		nslots = &heap->nevacslots;
 	}
 
-	// Check every block
-	for(long i = 0; i < nblocks; i++) {
-		gcbitsi = GC_NUM_BITS*i;
+	if(*nslots >= *maxslots) {
+		*maxslots = 1.5*(*maxslots + 1);
+		*slots = realloc(*slots,*maxslots*sizeof **slots);
+		assert(*slots);
+	}
 
-		flagsp = (*arena)->data + gcbitsi/8;
+	(*slots)[(*nslots)++] = slot;
+}
 
-		if(FIXED_GC_COLOR(*flagsp,gcbitsi%8)
-			== FIXED_GC_WHITE(gcbitsi%8)) {
-			freeblock = (free_block_t *)
-				((*arena)->blocks + i*(*arena)->size);
-			freeblock->next = *freelist;
-			*freelist = freeblock;
+// Shading: black it now, scan its children later
+#define SHADE_GC_TYPE(all, type) \
+static void MARK_TYPE(type,p)(type *x) { \
+	if(!mark_ptr(x)) \
+		gray_push(GC_TYPE(type),x); \
+}
 
-			*flagsp = *flagsp&~FIXED_GC_MASK(gcbitsi%8)
-				| FIXED_GC_FREE;
-		}
-	}
+EACH(SHADE_GC_TYPE,(),(),cell_t, env_t, htable_t, lambda_t)
+
+static void MARK_TYPE(string_t,p)(string_t *x) {
+	mark_ptr(x);
 }
 
-static void clean_buddy_arena(arena_t **arena) {
-	int sizeexp;
-	char *buddy, *endp, *p;
-	uint8_t *bflagsp, *flagsp;
+static void MARK_TYPE(void,p)(void *p) {
+	mark_ptr(p);
+}
 
-	// Step through all the blocks
-	endp = (char *) *arena + ARENA_SIZE;
-	for(p = (*arena)->blocks; p < endp; p += 1 << sizeexp) {
-		flagsp = BUDDY_FLAGSP(*arena,p);
-		sizeexp = BUDDY_MIN_EXP + (*flagsp&BUDDY_SIZE_MASK);
+static void MARK_TYPE(lambda_t,)(lambda_t x) {
+	MARK_TYPE(env_t,p)(x.env);
+	MARK_TYPE(cell_t,p)(x.args);
+	MARK_TYPE(cell_t,p)(x.body);
+}
 
-		// Only free allocated but unmarked blocks
-		if(BUDDY_GC_COLOR(*flagsp) != BUDDY_GC_WHITE)
-			continue;
+#define SCAN_TYPE(type) scan_##type
 
-		// Merge as many buddies as possible
-		while(true) {
-			buddy = (char *) ((uintptr_t) p ^ 1 << sizeexp);
+static void SCAN_TYPE(lambda_t)(lambda_t *x) {
+	record_slot(&x->env);
+	record_slot(&x->args);
+	record_slot(&x->body);
 
-			// Invalid buddy?
-			if(buddy < (*arena)->blocks)
-				break;
+	MARK_TYPE(lambda_t,)(*x);
+}
 
-			bflagsp = BUDDY_FLAGSP(*arena,buddy);
+static void SCAN_TYPE(cell_t)(cell_t *x) {
+	switch(cell_type(x)) {
+	// Symbols are compared by address
+	case VAL_SYM:
+		pin_ptr(x->sym);
+		MARK_TYPE(string_t,p)(x->sym);
+		break;
 
-			// Buddy not mergable?
-			if(BUDDY_GC_COLOR(*bflagsp) == BUDDY_GC_BLACK
-				|| sizeexp != BUDDY_MIN_EXP
-					+ (*bflagsp&BUDDY_SIZE_MASK))
-				break;
+	case VAL_STR:
+		record_slot(&x->str);
+		MARK_TYPE(string_t,p)(x->str);
+		break;
 
-			// Claim it for accounting purposes
-			if(BUDDY_GC_COLOR(*bflagsp) == BUDDY_GC_FREE)
-				buddy_claim_free_block(buddy);
+	case VAL_LBA:
+		SCAN_TYPE(lambda_t)(cell_lba(x));
+		break;
 
-			sizeexp++;
+	// The car is scanned first, so a long list keeps the gray stack short
+	case VAL_LST:
+		record_slot(&x->cdr);
+		record_slot(&x->car);
+		MARK_TYPE(cell_t,p)(x->cdr);
+		MARK_TYPE(cell_t,p)(x->car);
+		break;
 
-			if(buddy < p) {
-				p = buddy;
-				flagsp = bflagsp;
-			}
-		}
+	default: break;
+	}
+}
 
-		// 2^sizeexp bytes at p are free
-		buddy_add_free_block(p,sizeexp);
+static void SCAN_TYPE(env_t)(env_t *x) {
+	binding_t *binding;
 
-		*flagsp = BUDDY_GC_FREE | sizeexp - BUDDY_MIN_EXP;
+	record_slot(&x->parent);
+	record_slot(&x->tab);
+
+	MARK_TYPE(env_t,p)(x->parent);
+	MARK_TYPE(htable_t,p)(x->tab);
+
+	// Parameters go by the same strings as the symbols naming them
+	for(uint32_t i = 0; i < x->nslots; i++) {
+		binding = x->slots + i;
+
+		pin_ptr(binding->sym);
+		MARK_TYPE(string_t,p)(binding->sym);
+
+		record_slot(&binding->val);
+		MARK_TYPE(cell_t,p)(binding->val);
 	}
 }
 
-static void clean_large_arena(arena_t **arena) {
-	arena_t *next;
-	size_t headsize;
+static void scan_slots(htable_t *x, hslot_t *slots, uint32_t cap) {
+	void *p;
+	uint8_t *ctrl;
+	hslot_t *slot;
 
-	// Leave it if marked
-	if(ARENA_GC_COLOR((*arena)->flags) == ARENA_GC_BLACK)
-		return;
+	ctrl = HTABLE_CTRL(slots,cap);
+	for(uint32_t i = 0; i < cap; i++) {
+		if(!HTABLE_FULL(ctrl[i]))
+			continue;
 
-	// Free the whole arena
-	headsize = (*arena)->blocks - (char *) *arena;
-	heapsize -= headsize + (*arena)->size;
+		slot = slots + i;
 
-	next = (*arena)->next;
-	free(*arena);
-	*arena = next;
+		// Valueless keys are interned, so other things know them by
+		// address; only those other things keep them alive, though
+		if(slot->type == GC_TYPE(etc))
+			pin_ptr(slot->key);
+		else if(!HSLOT_KEY_INLINE(slot)) {
+			record_slot(&slot->key);
+			MARK_TYPE(void,p)(slot->key);
+		}
+
+		// Keys that point somewhere are hashed by address
+		if(x->keyrefs) {
+			memcpy(&p,HSLOT_KEY(slot),sizeof p);
+			pin_ptr(p);
+			MARK_TYPE(void,p)(p);
+		}
+
+		if(slot->type != GC_TYPE(etc)) {
+			record_slot(&slot->p);
+			markfuncs[slot->type](slot->p);
+		}
+	}
 }
 
-// Mark-and-sweep
-void mem_gc(stack_t *stack) {
-	struct {
-		EXPAND(EACH(PRINT_VARS,(;),(),EVAL_VARS));
-	} evalvars;
+static void SCAN_TYPE(htable_t)(htable_t *x) {
+	record_slot(&x->slots);
+	mark_ptr(x->slots);
+	scan_slots(x,x->slots,x->cap);
 
-	char *data;
-	arena_t **arena;
-	enum builtin type;
-	int64_t oldheapsize, oldheapallocd;
+	// Entries a resize has yet to move are only in the old slots
+	if(x->oldslots) {
+		record_slot(&x->oldslots);
+		mark_ptr(x->oldslots);
+		scan_slots(x,x->oldslots,x->oldcap);
+	}
+}
 
-	(void) oldheapsize;
-	(void) oldheapallocd;
+static void SCAN_TYPE(void)(void *p) {
+	(void) p;
+}
 
-	// Only do this if we need to
-	if(heapallocd < GC_USE_GROWTH*heapused)
-		return;
+#define REGISTER_SCAN_FUNC(all, type) \
+	[GC_TYPE(type)] = (mark_func_t) SCAN_TYPE(type)
 
-	debug("garbage collection (pre-cycle):"
-	    "\n\theap size: %lli"
-	    "\n\tallocated: %lli",
-		(long long) heapsize,(long long) heapallocd);
-	oldheapsize = heapsize;
-	oldheapallocd = heapallocd;
+static const mark_func_t scanfuncs[] = {
+	EACH(REGISTER_SCAN_FUNC,(,),(),GC_TYPES)
+};
 
-	// Accounting
-	heapallocd = 0;
+// Steals from the other markers until they are all out of work too
+static bool marker_steal_any(marker_t *m, gray_t *gray) {
+	marker_t *victim;
 
-	// Invert the meaning of all the GC bits
-	gcinvert = !gcinvert;
+	atomic_fetch_add(&heap->nidle,1);
 
-	// Mark from the stack's root set
-	data = stack->bottom;
-	while(data < stack->top) {
-		type = *(enum builtin *) data;
-		data += sizeof type;
+	while(atomic_load(&heap->nidle) < nmarkers
+		&& atomic_load_explicit(&heap->markbudget,memory_order_relaxed) > 0) {
+		victim = heap->markers + rand_r(&m->seed)%nmarkers;
 
-		// Handle the stack frame variables
-		switch(type) {
-			EXPAND(EACH(HANDLE_STACK_FRAME,(;),(),BUILTINS));
+		// Only busy markers push, so be busy while holding stolen work
+		if(victim != m && atomic_load(&victim->top)
+			< atomic_load(&victim->bottom)) {
+			atomic_fetch_sub(&heap->nidle,1);
+			if(marker_steal(victim,gray))
+				return true;
+			atomic_fetch_add(&heap->nidle,1);
 		}
 
-		// Skip the jmp_buf
-		data += sizeof(jmp_buf);
+		sched_yield();
 	}
 
-	// Mark from the handles' root set
-	for(uint32_t i = 0; i < nhandles; i++)
-		markfuncs[handles[i].type](handles[i].p);
+	return false;
+}
 
-	// Clean out each of the arenas
-	for(int i = 0; fixedarenas[i].arenas; i++)
-		for(arena = &fixedarenas[i].arenas; *arena;
-			*arena ? arena = &(*arena)->next : 0)
-			clean_fixed_arena(arena);
+// One marker's share of a parallel drain
+static void marker_run(marker_t *m) {
+	int64_t n;
+	gray_t gray;
 
-	for(arena = &buddyarenas; *arena; *arena ? arena = &(*arena)->next : 0)
-		clean_buddy_arena(arena);
+	curmarker = m;
 
-	for(arena = &largearenas; *arena; *arena ? arena = &(*arena)->next : 0)
-		clean_large_arena(arena);
+	while(atomic_fetch_sub_explicit(&heap->markbudget,MARK_SLICE,
+		memory_order_relaxed) > 0) {
+		for(n = 0; n < MARK_SLICE && marker_take(m,&gray); n++)
+			scanfuncs[gray.type](gray.p);
+		m->scanned += n;
 
-	heapused = heapallocd;
-	assert(heapused >= 0);
+		if(n < MARK_SLICE) {
+			if(!marker_steal_any(m,&gray))
+				break;
 
-	debug("garbage collection (post-cycle):"
-	    "\n\theap size: %lli (%+.2f%%)"
-	    "\n\tallocated: %lli (%+.2f%%)",
-		(long long) heapsize,
-		100.*(heapsize - oldheapsize)/oldheapsize,
-		(long long) heapallocd,
-		100.*(heapallocd - oldheapallocd)/oldheapallocd);
+			scanfuncs[gray.type](gray.p);
+			m->scanned++;
+		}
+	}
+
+	curmarker = NULL;
 }
 
-uint32_t mem_new_handle(gc_type_t type) {
-	assert(type != GC_TYPE(etc));
+static void *marker_main(void *arg) {
+	unsigned round;
+	marker_t *m = arg;
+
+	heap = m->heap;
+	round = 0;
+
+	pthread_mutex_lock(&heap->markmutex);
+	while(true) {
+		while(round == heap->markround)
+			pthread_cond_wait(&heap->markstart,&heap->markmutex);
+		round = heap->markround;
+		pthread_mutex_unlock(&heap->markmutex);
+
+		marker_run(m);
+
+		pthread_mutex_lock(&heap->markmutex);
+		if(!--heap->nmarking)
+			pthread_cond_signal(&heap->markdone);
+	}
+
+	return NULL;
+}
 
-	if(nhandles >= maxhandles) {
-		maxhandles = 1.5*(maxhandles + 1);
-		handles = realloc(handles,maxhandles*sizeof *handles);
-		assert(handles);
+static void start_markers() {
+	heap->markers = aligned_alloc(alignof(marker_t),
+		nmarkers*sizeof *heap->markers);
+	assert(heap->markers);
+
+	for(unsigned i = 0; i < nmarkers; i++) {
+		heap->markers[i].heap = heap;
+		atomic_init(&heap->markers[i].top,0);
+		atomic_init(&heap->markers[i].bottom,0);
+		atomic_init(&heap->markers[i].ring,ring_new(MARK_RING_SIZE,NULL));
+		heap->markers[i].allocd = 0;
+		heap->markers[i].scanned = 0;
+		heap->markers[i].seed = i + 1;
+		heap->markers[i].slots = NULL;
+		heap->markers[i].maxslots = 0;
+		heap->markers[i].nslots = 0;
 	}
 
-	handles[nhandles].type = type;
-	handles[nhandles].p = NULL;
+	// The calling thread is markers[0]
+	for(unsigned i = 1; i < nmarkers; i++)
+		if(pthread_create(&heap->markers[i].thread,NULL,marker_main,
+			heap->markers + i))
+			die("cannot start marker thread");
 
-	return nhandles++;
+	debug("started %u marker threads",nmarkers - 1);
 }
 
-void *mem_set_handle(uint32_t handle, void *p) {
-	assert(handle < nhandles);
+// Like mark_some(), but with every marker thread working together
+static bool mark_parallel(size_t budget) {
+	gray_t gray;
+	marker_t *m;
+	gray_ring_t *ring, *prev;
+
+	if(!heap->markers)
+		start_markers();
+
+	// Deal out the gray objects
+	for(size_t i = 0; i < heap->ngrays; i++)
+		marker_push(heap->markers + i%nmarkers,heap->grays[i].type,
+			heap->grays[i].p);
+	heap->ngrays = 0;
+
+	atomic_store(&heap->markbudget,budget < INT64_MAX ? (int64_t) budget
+		: INT64_MAX);
+	atomic_store(&heap->nidle,0);
+
+	pthread_mutex_lock(&heap->markmutex);
+	heap->nmarking = nmarkers - 1;
+	heap->markround++;
+	pthread_cond_broadcast(&heap->markstart);
+	pthread_mutex_unlock(&heap->markmutex);
+
+	marker_run(heap->markers);
+
+	pthread_mutex_lock(&heap->markmutex);
+	while(heap->nmarking)
+		pthread_cond_wait(&heap->markdone,&heap->markmutex);
+	pthread_mutex_unlock(&heap->markmutex);
+
+	// Gather up whatever the budget left behind
+	for(unsigned i = 0; i < nmarkers; i++) {
+		m = heap->markers + i;
+
+		while(marker_take(m,&gray))
+			gray_push(gray.type,gray.p);
+
+		ring = atomic_load(&m->ring);
+		for(; ring->prev; ring->prev = prev) {
+			prev = ring->prev->prev;
+			free(ring->prev);
+		}
 
-	handles[handle].p = p;
+		heap->heapallocd += m->allocd;
+		heap->gcscanned += m->scanned;
+		m->allocd = 0;
+		m->scanned = 0;
 
-	return p;
+		for(size_t j = 0; j < m->nslots; j++)
+			record_slot(m->slots[j]);
+		m->nslots = 0;
+	}
+
+	return !heap->ngrays;
 }
 
+// Scans up to budget gray objects; returns whether none are left
+static bool mark_some(size_t budget) {
+	if(nmarkers > 1 && heap->ngrays)
+		return mark_parallel(budget);
+
+	for(; heap->ngrays && budget; budget--) {
+		heap->ngrays--;
+		scanfuncs[heap->grays[heap->ngrays].type](heap->grays[heap->ngrays].p);
+		heap->gcscanned++;
+	}
+
+	return !heap->ngrays;
+}
+
+static void remember_immortal(gc_type_t type, void *p, bool whole) {
+	size_t i, oldcap;
+	immortal_ref_t *old;
+
+	if(2*(heap->nimmortalrefs + 1) > heap->immortalrefcap) {
+		old = heap->immortalrefs;
+		oldcap = heap->immortalrefcap;
+
+		heap->immortalrefcap = oldcap ? 2*oldcap : 1 << 8;
+		heap->immortalrefs = calloc(heap->immortalrefcap,
+			sizeof *heap->immortalrefs);
+		assert(heap->immortalrefs);
+
+		for(size_t j = 0; j < oldcap; j++) {
+			if(!old[j].p)
+				continue;
+
+			i = hash_ptr(old[j].p)&(heap->immortalrefcap - 1);
+			while(heap->immortalrefs[i].p)
+				i = (i + 1)&(heap->immortalrefcap - 1);
+			heap->immortalrefs[i] = old[j];
+		}
+
+		free(old);
+	}
+
+	for(i = hash_ptr(p)&(heap->immortalrefcap - 1); heap->immortalrefs[i].p;
+		i = (i + 1)&(heap->immortalrefcap - 1)) {
+		if(heap->immortalrefs[i].p == p
+			&& heap->immortalrefs[i].whole == whole) {
+			heap->immortalrefs[i].type = type;
+			return;
+		}
+	}
+
+	heap->immortalrefs[i] = (immortal_ref_t) {p,type,whole};
+	heap->nimmortalrefs++;
+}
+
+void mem_write_barrier(gc_type_t type, void *slot) {
+	void *p;
+
+	if(type == GC_TYPE(etc))
+		return;
+
+	memcpy(&p,slot,sizeof p);
+
+	// Nothing black may point to something white while marking
+	if(heap->gcmarking) {
+		markfuncs[type](p);
+
+		if(!is_indirect(type))
+			record_slot(slot);
+	}
+
+	// Immortal objects are never scanned, so the slot itself becomes a root
+	if(heap->immortalarenas && is_immortal(slot))
+		remember_immortal(type,slot,false);
+
+	// Only cells are ever young
+	if(type != GC_TYPE(cell_t) || IS_YOUNG(slot) || !IS_YOUNG(p))
+		return;
+
+	if(heap->nremembered >= heap->maxremembered) {
+		heap->maxremembered = 1.5*(heap->maxremembered + 1);
+		heap->remembered = realloc(heap->remembered,
+			heap->maxremembered*sizeof *heap->remembered);
+		assert(heap->remembered);
+	}
+
+	heap->remembered[heap->nremembered++] = slot;
+}
+
+// For an object about to be known by its address somewhere the collector
+// cannot see, like an interned string, so that it survives the cycle under way
+// and stays put; p must not hold any pointers itself
+void mem_pin_barrier(void *p) {
+	if(!heap->gcmarking)
+		return;
+
+	pin_ptr(p);
+	MARK_TYPE(void,p)(p);
+}
+
+// For a change to an object that no one slot describes, like a hashtable
+// getting a whole new bucket array
+void mem_object_barrier(gc_type_t type, void *p) {
+	if(heap->immortalarenas && is_immortal(p))
+		remember_immortal(type,p,true);
+}
+
+#define MARK_SHIM(all, var) MARK_SHIM_(all, var)
+#define MARK_SHIM_(t, q, v) MARK_SHIM__(t, q, SQUAL_##q, v)
+#define MARK_SHIM__(t, q, sq, v) MARK_SHIM___(t, q, sq, v)
+#define MARK_SHIM___(type, qual, squal, var) \
+static inline void mark_##var(type QUAL_##qual x) { \
+	MARK_TYPE(type,squal)(x); \
+}
+
+#define MARK_SHIMS(all, def) MARK_SHIMS_ def
+#define MARK_SHIMS_(type, qual, vars) \
+	DEFER(EACH_INDIRECT)()(MARK_SHIM,(),(type, qual),LITERAL vars)
+
+EXPAND(EACH(MARK_SHIMS,(),(),EVAL_VARS))
+
+// Copies a young cell into the fixed arenas, leaving a forwarding pointer
+static cell_t *nursery_evacuate(cell_t *x) {
+	cell_t *copy;
+
+	if(!IS_YOUNG(x))
+		return x;
+
+	if(x->car == NURSERY_FORWARDED)
+		return x->cdr;
+
+	copy = memcpy(mem_alloc(sizeof *copy),x,sizeof *copy);
+	x->car = NURSERY_FORWARDED;
+	x->cdr = copy;
+
+	if(censussites)
+		move_alloc_site(x,copy);
+
+	// The copy is allocated black, but its children might still be white
+	if(heap->gcmarking)
+		gray_push(GC_TYPE(cell_t),copy);
+
+	// Only lists can refer to other cells
+	if(cell_type(copy) == VAL_LST) {
+		if(heap->npromoted >= heap->maxpromoted) {
+			heap->maxpromoted = 1.5*(heap->maxpromoted + 1);
+			heap->promoted = realloc(heap->promoted,
+				heap->maxpromoted*sizeof *heap->promoted);
+			assert(heap->promoted);
+		}
+
+		heap->promoted[heap->npromoted++] = copy;
+	}
+
+	return copy;
+}
+
+#define EVAC_TYPE(t, sq) EVAC_TYPE_(t, sq)
+#define EVAC_TYPE_(type, squal) evac_##type##_##squal
+
+// Nothing but cells can be young, so most roots stay put
+static void EVAC_TYPE(bool,       )(bool *x)        { (void) x; }
+static void EVAC_TYPE(double,     )(double *x)      { (void) x; }
+static void EVAC_TYPE(int64_t,    )(int64_t *x)     { (void) x; }
+static void EVAC_TYPE(cell_type_t,)(cell_type_t *x) { (void) x; }
+static void EVAC_TYPE(env_t,     p)(env_t **x)      { (void) x; }
+static void EVAC_TYPE(lambda_t,  p)(lambda_t **x)   { (void) x; }
+
+static void EVAC_TYPE(cell_t,p)(cell_t **x) {
+	*x = nursery_evacuate(*x);
+}
+
+// Indirect cell roots point at a field inside a cell, so keep the offset
+static void EVAC_TYPE(cell_t,pp)(cell_t ***x) {
+	ptrdiff_t offset;
+	cell_t *cell;
+
+	if(!IS_YOUNG(*x))
+		return;
+
+	offset = ((char *) *x - heap->nursery)%sizeof *cell;
+	cell = nursery_evacuate((cell_t *) ((char *) *x - offset));
+	*x = (cell_t **) ((char *) cell + offset);
+}
+
+#define EVAC_SHIM(all, var) EVAC_SHIM_(all, var)
+#define EVAC_SHIM_(t, q, v) EVAC_SHIM__(t, q, SQUAL_##q, v)
+#define EVAC_SHIM__(t, q, sq, v) EVAC_SHIM___(t, q, sq, v)
+#define EVAC_SHIM___(type, qual, squal, var) \
+static inline void evac_##var(type QUAL_##qual *x) { \
+	EVAC_TYPE(type,squal)(x); \
+}
+
+#define EVAC_SHIMS(all, def) EVAC_SHIMS_ def
+#define EVAC_SHIMS_(type, qual, vars) \
+	DEFER(EACH_INDIRECT)()(EVAC_SHIM,(),(type, qual),LITERAL vars)
+
+EXPAND(EACH(EVAC_SHIMS,(),(),EVAL_VARS))
+
+#define EVAC_VAR_IN_DATA(all, var) do { \
+	memcpy(&evalvars.var,data,sizeof evalvars.var); \
+	evac_##var(&evalvars.var); \
+	memcpy(data,&evalvars.var,sizeof evalvars.var); \
+	data += sizeof evalvars.var; \
+} while(0)
+
+// Minor cycle: copy the nursery's survivors into the old generation. When
+// called after a full mark, slots in dead old objects no longer count as roots.
+static void nursery_collect(stack_t *stack, bool aftermark) {
+	struct {
+		EXPAND(EACH(PRINT_VARS,(;),(),EVAL_VARS));
+	} evalvars;
+
+	char *data;
+	cell_t *cell;
+	enum builtin type;
+	int64_t prevheapallocd;
+
+	(void) prevheapallocd;
+
+	if(heap->nurserytop == heap->nursery)
+		return;
+
+	heap->gcminors++;
+	prevheapallocd = heap->heapallocd;
+
+	// Update the stack's root set
+	data = stack->bottom;
+	while(data < stack->top) {
+		type = *(enum builtin *) data;
+		data += sizeof type;
+
+		// Handle the stack frame variables
+		switch(type) {
+			EXPAND(EACH(HANDLE_STACK_FRAME,(;),(EVAC_VAR_IN_DATA),
+				BUILTINS));
+		}
+
+		// Skip the jmp_buf
+		data += sizeof(jmp_buf);
+	}
+
+	// Update the handles' root set
+	for(uint32_t i = 0; i < heap->nhandles; i++) {
+		if(heap->handles[i].type == GC_TYPE(cell_t))
+			heap->handles[i].p = nursery_evacuate(heap->handles[i].p);
+		else if(heap->handles[i].type == GC_TYPE_INDIRECT(cell_t)
+			&& heap->handles[i].p)
+			EVAC_TYPE(cell_t,p)(heap->handles[i].p);
+	}
+
+	// Update old-to-young pointers
+	for(size_t i = 0; i < heap->nremembered; i++)
+		if(!aftermark || is_marked(heap->remembered[i]))
+			EVAC_TYPE(cell_t,p)(heap->remembered[i]);
+
+	// Update gray objects that have not been scanned yet
+	for(size_t i = 0, ngray = heap->ngrays; i < ngray; i++) {
+		if(heap->grays[i].type == GC_TYPE(cell_t)) {
+			cell = nursery_evacuate(heap->grays[i].p);
+			heap->grays[i].p = cell;
+		}
+	}
+
+	// Pull in everything reachable from the survivors
+	while(heap->npromoted) {
+		cell = heap->promoted[--heap->npromoted];
+		cell->car = nursery_evacuate(cell->car);
+		cell->cdr = nursery_evacuate(cell->cdr);
+	}
+
+	debug("minor garbage collection:"
+	    "\n\tnursery used: %lli"
+	    "\n\tpromoted:     %lli",
+		(long long) (heap->nurserytop - heap->nursery),
+		(long long) (heap->heapallocd - prevheapallocd));
+
+	memset(heap->nurserymarks,0,
+		(heap->nurserytop - heap->nursery)/sizeof(cell_t)/8 + 1);
+	heap->nurserytop = heap->nursery;
+	heap->nremembered = 0;
+}
+
+static int compare_ptrs(const void *a, const void *b) {
+	uintptr_t x, y;
+
+	x = *(uintptr_t *) a;
+	y = *(uintptr_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+// Picks out the sparse buddy arenas to empty this cycle, if fragmentation is
+// bad enough to bother; needs to come after finish_sweep()
+static void select_evacuees() {
+	int sizeexp;
+	char *endp, *p;
+	uint8_t *flagsp;
+	arena_t *arena;
+	size_t live, maxevacuees, total;
+
+	if(!gccompact)
+		return;
+
+	live = total = 0;
+	for(arena = heap->buddyarenas; arena; arena = arena->next) {
+		live += arena->size;
+		total += (char *) arena + ARENA_SIZE - arena->blocks;
+	}
+
+	if(!total || live > (1 - COMPACT_THRESH)*total)
+		return;
+
+	maxevacuees = 0;
+	heap->nevacuees = 0;
+
+	pthread_mutex_lock(&heap->sweepmutex);
+
+	for(arena = heap->buddyarenas; arena; arena = arena->next) {
+		if(arena->size >= COMPACT_SPARSE*ARENA_SIZE)
+			continue;
+
+		// Nothing new goes in while it is being emptied
+		endp = (char *) arena + ARENA_SIZE;
+		for(p = arena->blocks; p < endp; p += 1 << sizeexp) {
+			flagsp = BUDDY_FLAGSP(arena,p);
+			sizeexp = BUDDY_MIN_EXP + (*flagsp&BUDDY_SIZE_MASK);
+
+			if(BUDDY_GC_COLOR(*flagsp) == BUDDY_GC_FREE)
+				buddy_claim_free_block(p);
+		}
+
+		arena->flags |= ARENA_EVACUATE;
+
+		if(heap->nevacuees >= maxevacuees) {
+			maxevacuees = 1.5*(maxevacuees + 1);
+			heap->evacuees = realloc(heap->evacuees,
+				maxevacuees*sizeof *heap->evacuees);
+			assert(heap->evacuees);
+		}
+
+		heap->evacuees[heap->nevacuees++] = arena;
+	}
+
+	pthread_mutex_unlock(&heap->sweepmutex);
+
+	qsort(heap->evacuees,heap->nevacuees,sizeof *heap->evacuees,compare_ptrs);
+	heap->gccompacting = heap->nevacuees > 0;
+
+	debug("compaction (pre-cycle):"
+	    "\n\tfragmentation: %.2f%%"
+	    "\n\tcandidates:    %i arenas",
+		100.*(total - live)/total,(int) heap->nevacuees);
+}
+
+// Where p ended up, if its block was evacuated
+static void *forward(void *p) {
+	size_t u;
+	char *copy, *start;
+	arena_t *arena;
+
+	arena = (arena_t *) ((uintptr_t) p&~(ARENA_SIZE - 1));
+
+	if(!p || CELL_IS_IMMEDIATE(p) || !bsearch(&arena,heap->evacuees,
+		heap->nevacuees,sizeof *heap->evacuees,compare_ptrs)
+		|| (char *) p < arena->blocks)
+		return p;
+
+	u = BUDDY_UNIT(arena,p);
+	if(arena->moved[u] == NOT_MOVED)
+		return p;
+
+	// The old block starts with the address of the new one
+	start = arena->blocks + (u - arena->moved[u])*BUDDY_MIN_ALLOC;
+	memcpy(&copy,start,sizeof copy);
+
+	return copy + ((char *) p - start);
+}
+
+#define FWD_TYPE(t, sq) FWD_TYPE_(t, sq)
+#define FWD_TYPE_(type, squal) fwd_##type##_##squal
+
+static void FWD_TYPE(bool,       )(bool *x)        { (void) x; }
+static void FWD_TYPE(double,     )(double *x)      { (void) x; }
+static void FWD_TYPE(int64_t,    )(int64_t *x)     { (void) x; }
+static void FWD_TYPE(cell_type_t,)(cell_type_t *x) { (void) x; }
+
+static void FWD_TYPE(cell_t,  p)(cell_t **x)   { *x = forward(*x); }
+static void FWD_TYPE(cell_t, pp)(cell_t ***x)  { *x = forward(*x); }
+static void FWD_TYPE(env_t,   p)(env_t **x)    { *x = forward(*x); }
+static void FWD_TYPE(lambda_t,p)(lambda_t **x) { *x = forward(*x); }
+
+#define FWD_SHIM(all, var) FWD_SHIM_(all, var)
+#define FWD_SHIM_(t, q, v) FWD_SHIM__(t, q, SQUAL_##q, v)
+#define FWD_SHIM__(t, q, sq, v) FWD_SHIM___(t, q, sq, v)
+#define FWD_SHIM___(type, qual, squal, var) \
+static inline void fwd_##var(type QUAL_##qual *x) { \
+	FWD_TYPE(type,squal)(x); \
+}
+
+#define FWD_SHIMS(all, def) FWD_SHIMS_ def
+#define FWD_SHIMS_(type, qual, vars) \
+	DEFER(EACH_INDIRECT)()(FWD_SHIM,(),(type, qual),LITERAL vars)
+
+EXPAND(EACH(FWD_SHIMS,(),(),EVAL_VARS))
+
+#define FWD_VAR_IN_DATA(all, var) do { \
+	memcpy(&evalvars.var,data,sizeof evalvars.var); \
+	fwd_##var(&evalvars.var); \
+	memcpy(data,&evalvars.var,sizeof evalvars.var); \
+	data += sizeof evalvars.var; \
+} while(0)
+
+// Copies the marked blocks out of the selected arenas, then points everything
+// at the copies. Runs at the end of marking, once the nursery is empty.
+static void evacuate(stack_t *stack) {
+	struct {
+		EXPAND(EACH(PRINT_VARS,(;),(),EVAL_VARS));
+	} evalvars;
+
+	int sizeexp;
+	char *copy, *data, *endp, *p;
+	void *slot;
+	size_t n, nunits;
+	uint8_t *flagsp;
+	arena_t *arena, **link;
+	enum builtin type;
+	int64_t moved;
+
+	if(!heap->gccompacting)
+		return;
+
+	assert(!heap->ngrays && heap->nurserytop == heap->nursery);
+
+	moved = 0;
+	n = 0;
+
+	for(size_t i = 0; i < heap->nevacuees; i++) {
+		arena = heap->evacuees[i];
+		endp = (char *) arena + ARENA_SIZE;
+
+		// Something in it is known by address, so give it back as it is
+		if(arena->flags&ARENA_PINNED) {
+			arena->flags &= ~(ARENA_EVACUATE | ARENA_PINNED);
+
+			pthread_mutex_lock(&heap->sweepmutex);
+			for(p = arena->blocks; p < endp; p += 1 << sizeexp) {
+				flagsp = BUDDY_FLAGSP(arena,p);
+				sizeexp = BUDDY_MIN_EXP
+					+ (*flagsp&BUDDY_SIZE_MASK);
+
+				if(BUDDY_GC_COLOR(*flagsp) == BUDDY_GC_FREE)
+					buddy_add_free_block(p,sizeexp);
+			}
+			pthread_mutex_unlock(&heap->sweepmutex);
+
+			continue;
+		}
+
+		nunits = (endp - arena->blocks)/BUDDY_MIN_ALLOC;
+		arena->moved = malloc(nunits*sizeof *arena->moved);
+		assert(arena->moved);
+
+		for(p = arena->blocks; p < endp; p += 1 << sizeexp) {
+			flagsp = BUDDY_FLAGSP(arena,p);
+			sizeexp = BUDDY_MIN_EXP + (*flagsp&BUDDY_SIZE_MASK);
+
+			// Only the marked blocks are worth keeping
+			if(BUDDY_GC_COLOR(*flagsp) != BUDDY_GC_BLACK) {
+				for(int u = 0; u < 1 << sizeexp
+					- BUDDY_MIN_EXP; u++)
+					arena->moved[BUDDY_UNIT(arena,p) + u]
+						= NOT_MOVED;
+				continue;
+			}
+
+			copy = buddy_alloc(&heap->buddyarenas,1 << sizeexp);
+			memcpy(copy,p,1 << sizeexp);
+			memcpy(p,&copy,sizeof copy);
+
+			if(censussites)
+				move_alloc_site(p,copy);
+
+			for(int u = 0; u < 1 << sizeexp - BUDDY_MIN_EXP; u++)
+				arena->moved[BUDDY_UNIT(arena,p) + u] = u;
+
+			heap->heapallocd -= 1 << sizeexp;
+			moved += 1 << sizeexp;
+		}
+
+		heap->evacuees[n++] = arena;
+	}
+
+	heap->nevacuees = n;
+
+	// Fix up the slots found while marking; the nursery is empty by now, so
+	// any young ones are stale
+	for(size_t i = 0; i < heap->nevacslots; i++) {
+		if(IS_YOUNG(heap->evacslots[i]))
+			continue;
+
+		slot = forward(heap->evacslots[i]);
+		memcpy(&p,slot,sizeof p);
+		p = forward(p);
+		memcpy(slot,&p,sizeof p);
+	}
+
+	// Update the stack's root set
+	data = stack->bottom;
+	while(data < stack->top) {
+		type = *(enum builtin *) data;
+		data += sizeof type;
+
+		// Handle the stack frame variables
+		switch(type) {
+			EXPAND(EACH(HANDLE_STACK_FRAME,(;),(FWD_VAR_IN_DATA),
+				BUILTINS));
+		}
+
+		// Skip the jmp_buf
+		data += sizeof(jmp_buf);
+	}
+
+	// Update the handles' root set
+	for(uint32_t i = 0; i < heap->nhandles; i++) {
+		if(!is_indirect(heap->handles[i].type))
+			heap->handles[i].p = forward(heap->handles[i].p);
+		else if(heap->handles[i].p) {
+			memcpy(&p,heap->handles[i].p,sizeof p);
+			p = forward(p);
+			memcpy(heap->handles[i].p,&p,sizeof p);
+		}
+	}
+
+	// Now the emptied arenas can go
+	pthread_mutex_lock(&heap->sweepmutex);
+	for(link = &heap->buddyarenas; arena = *link;) {
+		if(!(arena->flags&ARENA_EVACUATE)) {
+			link = &arena->next;
+			continue;
+		}
+
+		*link = arena->next;
+		arena->next = heap->sweptempty;
+		heap->sweptempty = arena;
+
+		arena->flags &= ~ARENA_EVACUATE;
+		free(arena->moved);
+		arena->moved = NULL;
+	}
+	pthread_mutex_unlock(&heap->sweepmutex);
+
+	debug("compaction (post-cycle):"
+	    "\n\tevacuated: %i arenas"
+	    "\n\tmoved:     %lli bytes (%lli slots to fix)",
+		(int) heap->nevacuees,(long long) moved,(long long) heap->nevacslots);
+
+	heap->gccompacting = false;
+	heap->nevacuees = 0;
+	heap->nevacslots = 0;
+}
+
+static inline int ctz64(uint64_t x) {
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	int n;
+
+	for(n = 0; !(x&1); x >>= 1)
+		n++;
+
+	return n;
+#endif
+}
+
+static inline int popcount64(uint64_t x) {
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	int n;
+
+	for(n = 0; x; x &= x - 1)
+		n++;
+
+	return n;
+#endif
+}
+
+// The GC bits of 32 fixed blocks, with block i's in bits 2i and 2i + 1
+static inline uint64_t load_gc_word(uint8_t *flagsp) {
+	uint64_t word;
+
+	word = 0;
+	for(int i = 0; i < 8; i++)
+		word |= (uint64_t) flagsp[i] << 8*i;
+
+	return word;
+}
+
+static inline void store_gc_word(uint8_t *flagsp, uint64_t word) {
+	for(int i = 0; i < 8; i++)
+		flagsp[i] = word >> 8*i;
+}
+
+// Returns whether nothing in the arena survived
+static bool clean_fixed_arena(arena_t **arena) {
+	char *flagsp;
+	double start;
+	long gcbitsi, i, nblocks, nfreed, nlive;
+	uint64_t bit0s, bit1s, black, white, word;
+	free_block_t *freeblock, **freelist;
+
+	start = now();
+
+	// How many blocks to check, and where to put newly freed blocks
+	if((*arena)->flags&ARENA_NEW) {
+		nblocks = ((char *) (*arena)->freelist - (*arena)->blocks)
+			/(*arena)->size;
+		freelist = &((free_block_t *) ((uintptr_t) *arena + ARENA_SIZE
+			- (*arena)->size))->next;
+	} else {
+		nblocks = ((char *) *arena + ARENA_SIZE - (*arena)->blocks)
+			/(*arena)->size;
+		freelist = &(*arena)->freelist;
+	}
+
+	// Check 32 blocks at a time; an all-black word needs nothing more
+	nlive = 0;
+	nfreed = 0;
+	for(i = 0; i + 32 <= nblocks; i += 32) {
+		flagsp = (*arena)->data + GC_NUM_BITS*i/8;
+		word = load_gc_word((uint8_t *) flagsp);
+
+		bit0s = word&FIXED_GC_BIT0S;
+		bit1s = word >> 1&FIXED_GC_BIT0S;
+		black = heap->gcinvert ? bit1s&~bit0s : bit0s&~bit1s;
+		white = heap->gcinvert ? bit0s&~bit1s : bit1s&~bit0s;
+
+		nlive += popcount64(black);
+
+		if(!white)
+			continue;
+
+		nfreed += popcount64(white);
+
+		for(uint64_t w = white; w; w &= w - 1) {
+			freeblock = (free_block_t *) ((*arena)->blocks
+				+ (i + ctz64(w)/GC_NUM_BITS)*(*arena)->size);
+			freeblock->next = *freelist;
+			*freelist = freeblock;
+		}
+
+		// White blocks have just the one bit set, so clearing it frees them
+		store_gc_word((uint8_t *) flagsp,
+			word&~(heap->gcinvert ? white : white << 1));
+	}
+
+	// Then the leftovers one at a time
+	for(; i < nblocks; i++) {
+		gcbitsi = GC_NUM_BITS*i;
+
+		flagsp = (*arena)->data + gcbitsi/8;
+
+		if(FIXED_GC_COLOR(*flagsp,gcbitsi%8)
+			== FIXED_GC_BLACK(gcbitsi%8))
+			nlive++;
+		else if(FIXED_GC_COLOR(*flagsp,gcbitsi%8)
+			== FIXED_GC_WHITE(gcbitsi%8)) {
+			freeblock = (free_block_t *)
+				((*arena)->blocks + i*(*arena)->size);
+			freeblock->next = *freelist;
+			*freelist = freeblock;
+
+			*flagsp = *flagsp&~FIXED_GC_MASK(gcbitsi%8)
+				| FIXED_GC_FREE;
+			nfreed++;
+		}
+	}
+
+	note_sweep(ARENA_FIXED,nfreed*(*arena)->size,start);
+
+	return !nlive;
+}
+
+// Returns whether nothing in the arena survived; an empty arena's blocks are
+// taken back off the free lists
+static bool clean_buddy_arena(arena_t **arena) {
+	int sizeexp;
+	double start;
+	size_t freed, live;
+	char *buddy, *endp, *p;
+	uint8_t *bflagsp, *flagsp;
+
+	start = now();
+
+	// Step through all the blocks
+	freed = live = 0;
+	endp = (char *) *arena + ARENA_SIZE;
+	for(p = (*arena)->blocks; p < endp; p += 1 << sizeexp) {
+		flagsp = BUDDY_FLAGSP(*arena,p);
+		sizeexp = BUDDY_MIN_EXP + (*flagsp&BUDDY_SIZE_MASK);
+
+		// Only free allocated but unmarked blocks
+		if(BUDDY_GC_COLOR(*flagsp) == BUDDY_GC_BLACK)
+			live += 1 << sizeexp;
+		if(BUDDY_GC_COLOR(*flagsp) != BUDDY_GC_WHITE)
+			continue;
+
+		freed += 1 << sizeexp;
+
+		// Merge as many buddies as possible
+		while(true) {
+			buddy = (char *) ((uintptr_t) p ^ 1 << sizeexp);
+
+			// Invalid buddy?
+			if(buddy < (*arena)->blocks)
+				break;
+
+			bflagsp = BUDDY_FLAGSP(*arena,buddy);
+
+			// Buddy not mergable?
+			if(BUDDY_GC_COLOR(*bflagsp) == BUDDY_GC_BLACK
+				|| sizeexp != BUDDY_MIN_EXP
+					+ (*bflagsp&BUDDY_SIZE_MASK))
+				break;
+
+			// Claim it for accounting purposes
+			if(BUDDY_GC_COLOR(*bflagsp) == BUDDY_GC_FREE)
+				buddy_claim_free_block(buddy);
+
+			sizeexp++;
+
+			if(buddy < p) {
+				p = buddy;
+				flagsp = bflagsp;
+			}
+		}
+
+		// 2^sizeexp bytes at p are free
+		buddy_add_free_block(p,sizeexp);
+
+		*flagsp = BUDDY_GC_FREE | sizeexp - BUDDY_MIN_EXP;
+	}
+
+	(*arena)->size = live;
+
+	note_sweep(ARENA_BUDDY,freed,start);
+
+	if(live)
+		return false;
+
+	// Everything is free, so none of it may be handed out from here
+	for(p = (*arena)->blocks; p < endp; p += 1 << sizeexp) {
+		flagsp = BUDDY_FLAGSP(*arena,p);
+		sizeexp = BUDDY_MIN_EXP + (*flagsp&BUDDY_SIZE_MASK);
+
+		buddy_claim_free_block(p);
+	}
+
+	return true;
+}
+
+// Returns whether the arena was freed, and so unlinked
+static bool clean_large_arena(arena_t **arena) {
+	arena_t *next;
+	size_t mapsize;
+
+	// Leave it if marked
+	if(ARENA_GC_COLOR((*arena)->flags) == ARENA_GC_BLACK)
+		return false;
+
+	// Free the whole arena
+	mapsize = large_map_size((*arena)->size);
+	heap->heapsize -= mapsize;
+	note_sweep(ARENA_LARGE,(*arena)->size,now());
+
+	next = (*arena)->next;
+	munmap(*arena,mapsize);
+	*arena = next;
+
+	return true;
+}
+
+static void *sweeper_main(void *arg) {
+	unsigned round;
+	arena_t *arena, **list;
+
+	heap = arg;
+	round = 0;
+
+	pthread_mutex_lock(&heap->sweepmutex);
+	while(true) {
+		while(round == heap->sweepround)
+			pthread_cond_wait(&heap->sweepstart,&heap->sweepmutex);
+		round = heap->sweepround;
+
+		// Nobody else touches a fixed arena while it is in hand
+		for(int i = 0; heap->fixedarenas[i].size; i++)
+			while(arena = heap->fixedarenas[i].unswept) {
+				heap->fixedarenas[i].unswept = arena->next;
+				heap->sweeping = true;
+				pthread_mutex_unlock(&heap->sweepmutex);
+
+				list = clean_fixed_arena(&arena) ? &heap->sweptempty
+					: &heap->fixedarenas[i].swept;
+
+				pthread_mutex_lock(&heap->sweepmutex);
+				arena->next = *list;
+				*list = arena;
+				heap->sweeping = false;
+				pthread_cond_signal(&heap->sweepdone);
+			}
+
+		// Buddy arenas share the free lists, so hold the lock throughout
+		while(buddy_sweep_next()) {
+			pthread_mutex_unlock(&heap->sweepmutex);
+			pthread_mutex_lock(&heap->sweepmutex);
+		}
+	}
+
+	return NULL;
+}
+
+// Leave the small arenas to be swept in the background or as they are needed
+static void defer_sweep() {
+	arena_t **tail;
+
+	if(sweepthread && !heap->sweeperstarted) {
+		if(pthread_create(&heap->sweeper,NULL,sweeper_main,heap))
+			die("cannot start sweeper thread");
+		heap->sweeperstarted = true;
+
+		debug("started sweeper thread");
+	}
+
+	pthread_mutex_lock(&heap->sweepmutex);
+
+	for(int i = 0; heap->fixedarenas[i].size; i++) {
+		assert(!heap->fixedarenas[i].unswept && !heap->fixedarenas[i].swept);
+
+		// Full arenas may have room again once swept
+		for(tail = &heap->fixedarenas[i].arenas; *tail; tail = &(*tail)->next);
+		*tail = heap->fixedarenas[i].full;
+
+		heap->fixedarenas[i].unswept = heap->fixedarenas[i].arenas;
+		heap->fixedarenas[i].arenas = NULL;
+		heap->fixedarenas[i].full = NULL;
+	}
+
+	heap->buddyunswept = &heap->buddyarenas;
+
+	heap->sweepround++;
+	pthread_cond_signal(&heap->sweepstart);
+
+	pthread_mutex_unlock(&heap->sweepmutex);
+}
+
+// White blocks must all be gone before the GC bits are inverted again
+static void finish_sweep() {
+	// Help out with whatever the sweeper has not reached
+	for(int i = 0; heap->fixedarenas[i].size; i++)
+		while(fixed_next_swept(i));
+
+	pthread_mutex_lock(&heap->sweepmutex);
+	while(buddy_sweep_next());
+	while(heap->sweeping)
+		pthread_cond_wait(&heap->sweepdone,&heap->sweepmutex);
+	pthread_mutex_unlock(&heap->sweepmutex);
+
+	// Pick up the sweeper's last arena
+	for(int i = 0; heap->fixedarenas[i].size; i++)
+		while(fixed_next_swept(i));
+
+	reclaim_empty_arenas();
+}
+
+static void mark_roots(stack_t *stack) {
+	struct {
+		EXPAND(EACH(PRINT_VARS,(;),(),EVAL_VARS));
+	} evalvars;
+
+	void *p;
+	char *data;
+	enum builtin type;
+	immortal_ref_t *ref;
+
+	// Mark from the stack's root set
+	data = stack->bottom;
+	while(data < stack->top) {
+		type = *(enum builtin *) data;
+		data += sizeof type;
+
+		// Handle the stack frame variables
+		switch(type) {
+			EXPAND(EACH(HANDLE_STACK_FRAME,(;),(MARK_VAR_FROM_DATA),
+				BUILTINS));
+		}
+
+		// Skip the jmp_buf
+		data += sizeof(jmp_buf);
+	}
+
+	// Mark from the handles' root set
+	for(uint32_t i = 0; i < heap->nhandles; i++)
+		markfuncs[heap->handles[i].type](heap->handles[i].p);
+
+	// Mark from whatever immortal objects have been changed to point to
+	for(size_t i = 0; i < heap->immortalrefcap; i++) {
+		if(!(ref = heap->immortalrefs + i)->p)
+			continue;
+
+		if(ref->whole)
+			scanfuncs[ref->type](ref->p);
+		else {
+			memcpy(&p,ref->p,sizeof p);
+			markfuncs[ref->type](p);
+
+			if(!is_indirect(ref->type))
+				record_slot(ref->p);
+		}
+	}
+}
+
+// Deletes the valueless entries whose keys went unmarked from some slots,
+// saying how many; only the new ones' tombstones are worth counting
+static uint32_t prune_slots(htable_t *tab, hslot_t *slots, uint32_t cap,
+	bool old) {
+	uint8_t *ctrl;
+	uint32_t pruned;
+	hslot_t *slot;
+
+	pruned = 0;
+
+	ctrl = HTABLE_CTRL(slots,cap);
+	for(uint32_t i = 0; i < cap; i++) {
+		slot = slots + i;
+		if(!HTABLE_FULL(ctrl[i]) || slot->type != GC_TYPE(etc)
+			|| is_marked(slot->key))
+			continue;
+
+		ctrl[i] = HTABLE_DELETED;
+		tab->nentries--;
+		if(!old)
+			tab->ndeleted++;
+		tab->pruned = true;
+		pruned++;
+	}
+
+	return pruned;
+}
+
+// Prunes the tables behind weak handles; each table shrinks to fit as it is
+// next inserted into
+static void prune_weak_tables() {
+	uint32_t pruned;
+	htable_t *tab;
+
+	pruned = 0;
+
+	for(uint32_t h = 0; h < heap->nhandles; h++) {
+		if(!heap->handles[h].weak || !(tab = heap->handles[h].p))
+			continue;
+
+		pruned += prune_slots(tab,tab->slots,tab->cap,false);
+		if(tab->oldslots)
+			pruned += prune_slots(tab,tab->oldslots,tab->oldcap,
+				true);
+	}
+
+	heap->gcpruned += pruned;
+
+	debug("pruned %u weak hashtable entries",pruned);
+}
+
+// Works out how much allocation the next cycle waits for
+static void set_trigger() {
+	double trigger;
+
+	trigger = fmax(gcminheap,gcgrowth*heap->heapused);
+
+	// Nearing the soft limit, leave the next cycle half of what remains
+	if(gclimit)
+		trigger = fmin(trigger,fmax(heap->heapused
+			+ (gclimit - heap->heapused)/2.,
+			(1 + GC_LIMIT_MIN_GROWTH)*heap->heapused));
+
+	heap->gctrigger = trigger;
+}
+
+// Incremental mark-and-sweep
+void mem_gc(stack_t *stack) {
+	bool done;
+	double entry, pause, start;
+	arena_t **arena;
+
+	if(!heap->gcmarking) {
+		// Only do this if we need to
+		if(heap->heapallocd < heap->gctrigger && !heap->gcforced) {
+			if(heap->nurserytop - heap->nursery
+				>= NURSERY_THRESH*NURSERY_SIZE) {
+				entry = now();
+				nursery_collect(stack,false);
+				note_pause(now() - entry);
+			}
+
+			return;
+		}
+
+		entry = now();
+
+		finish_sweep();
+		select_evacuees();
+
+		debug("garbage collection (pre-cycle):"
+		    "\n\theap size: %lli"
+		    "\n\tallocated: %lli"
+		    "\n\tresident:  %lli (%u arenas released since the last cycle)",
+			(long long) heap->heapsize,(long long) heap->heapallocd,resident(),
+			heap->gcreleased);
+		heap->oldheapsize = heap->heapsize;
+		heap->oldheapallocd = heap->heapallocd;
+
+		// Accounting
+		heap->heapallocd = 0;
+		heap->gcreleased = 0;
+		heap->gcscanned = 0;
+		heap->gcmarktime = 0;
+		heap->gcmaxpause = 0;
+
+		// Invert the meaning of all the GC bits
+		heap->gcinvert = !heap->gcinvert;
+		heap->gcmarking = true;
+
+		mark_roots(stack);
+	} else {
+		entry = now();
+
+		if(heap->nurserytop - heap->nursery >= NURSERY_THRESH*NURSERY_SIZE)
+			nursery_collect(stack,false);
+	}
+
+	// Spread the marking out over many safepoints
+	start = now();
+	done = mark_some(heap->gcforced ? SIZE_MAX : gcmarkbudget*nmarkers);
+	pause = now() - start;
+	heap->gcmarktime += pause;
+	heap->gcmaxpause = fmax(heap->gcmaxpause,pause);
+
+	if(!done) {
+		note_pause(now() - entry);
+		return;
+	}
+
+	// The write barrier does not watch the roots, so finish with them
+	start = now();
+	mark_roots(stack);
+	mark_some(SIZE_MAX);
+
+	// Move the young survivors out; everything they reach is marked already
+	nursery_collect(stack,true);
+	mark_some(SIZE_MAX);
+
+	prune_weak_tables();
+
+	evacuate(stack);
+	pause = now() - start;
+	heap->gcmarktime += pause;
+	heap->gcmaxpause = fmax(heap->gcmaxpause,pause);
+
+	heap->gcmarking = false;
+
+	// Large arenas are cheap to check; the rest are swept after the pause
+	defer_sweep();
+
+	for(arena = &heap->largearenas; *arena; )
+		if(!clean_large_arena(arena))
+			arena = &(*arena)->next;
+
+	heap->heapused = heap->heapallocd;
+	assert(heap->heapused >= 0);
+	set_trigger();
+
+	heap->gccycles++;
+	heap->gctotalmarktime += heap->gcmarktime;
+	note_pause(now() - entry);
+
+	debug("garbage collection (post-cycle):"
+	    "\n\theap size: %lli (%+.2f%%)"
+	    "\n\tallocated: %lli (%+.2f%%)"
+	    "\n\tscanned:   %lli in %.3f ms (%.0f objects/s)"
+	    "\n\tpause:     %.3f ms at most (%u markers)"
+	    "\n\tresident:  %lli",
+		(long long) heap->heapsize,
+		100.*(heap->heapsize - heap->oldheapsize)/heap->oldheapsize,
+		(long long) heap->heapallocd,
+		100.*(heap->heapallocd - heap->oldheapallocd)/heap->oldheapallocd,
+		(long long) heap->gcscanned,1e3*heap->gcmarktime,
+		heap->gcscanned/heap->gcmarktime,
+		1e3*heap->gcmaxpause,nmarkers,resident());
+}
+
+// A whole cycle, sweeping included, regardless of pacing
+void mem_gc_now(stack_t *stack) {
+	heap->gcforced = true;
+
+	// A cycle already under way might keep things that have died since
+	if(heap->gcmarking)
+		mem_gc(stack);
+	mem_gc(stack);
+
+	heap->gcforced = false;
+
+	finish_sweep();
+}
+
+// Moves a list of arenas into the immortal region
+static void freeze_arenas(arena_t **arenas) {
+	arena_t *arena;
+
+	while(arena = *arenas) {
+		*arenas = arena->next;
+
+		arena->flags |= ARENA_IMMORTAL;
+		arena->next = heap->immortalarenas;
+		heap->immortalarenas = arena;
+
+		heap->heapsize -= ARENA_SIZE;
+		heap->immortalsize += ARENA_SIZE;
+	}
+}
+
+// Promotes everything still live into the immortal region, in place. Later
+// cycles neither mark through it nor sweep it, so their work scales with
+// what has been allocated since; free space in the promoted arenas is lost.
+void mem_freeze(stack_t *stack) {
+	arena_t *arena;
+	int64_t prevsize;
+
+	(void) prevsize;
+
+	mem_gc_now(stack);
+	assert(!heap->gcmarking && heap->nurserytop == heap->nursery);
+
+	prevsize = heap->immortalsize;
+
+	for(int i = 0; heap->fixedarenas[i].size; i++) {
+		freeze_arenas(&heap->fixedarenas[i].arenas);
+		freeze_arenas(&heap->fixedarenas[i].full);
+	}
+
+	freeze_arenas(&heap->buddyarenas);
+	for(int i = 0; i < BUDDY_MAX_EXP; i++)
+		heap->buddyfree[i].next = NULL;
+
+	while(arena = heap->largearenas) {
+		heap->largearenas = arena->next;
+
+		arena->flags |= ARENA_IMMORTAL;
+		arena->next = heap->immortalarenas;
+		heap->immortalarenas = arena;
+
+		heap->heapsize -= large_map_size(arena->size);
+		heap->immortalsize += large_map_size(arena->size);
+
+		if(heap->nimmortallarge >= heap->maximmortallarge) {
+			heap->maximmortallarge = 1.5*(heap->maximmortallarge + 1);
+			heap->immortallarge = realloc(heap->immortallarge,
+				heap->maximmortallarge*sizeof *heap->immortallarge);
+			assert(heap->immortallarge);
+		}
+
+		heap->immortallarge[heap->nimmortallarge++] = arena;
+	}
+
+	qsort(heap->immortallarge,heap->nimmortallarge,
+		sizeof *heap->immortallarge,compare_ptrs);
+
+	// What was live is now someone else's problem
+	heap->heapallocd = heap->heapused = 0;
+	set_trigger();
+
+	debug("froze the heap:"
+	    "\n\tpromoted: %lli"
+	    "\n\timmortal: %lli",
+		(long long) (heap->immortalsize - prevsize),
+		(long long) heap->immortalsize);
+}
+
+// What the census sorts objects into; cells go by cell type, which come first
+typedef enum census_kind {
+	CENSUS_LIST = NUM_VAL_TYPES,
+	CENSUS_ENV,
+	CENSUS_HTABLE,
+	CENSUS_SLOTS,
+	CENSUS_KEY,
+	CENSUS_STRING,
+	CENSUS_BYTES, // Anything only known as void *
+
+	NUM_CENSUS_KINDS,
+
+	// Only while tracing
+	CENSUS_CELL = NUM_CENSUS_KINDS, // Sorted by cell type once reached
+	CENSUS_LAMBDA                   // Part of a cell, so not counted itself
+} census_kind_t;
+
+static const char *const censuskinds[NUM_CENSUS_KINDS] = {
+	[VAL_NIL]        = "cell:nil",
+	[VAL_SYM]        = "cell:symbol",
+	[VAL_I64]        = "cell:int",
+	[VAL_DBL]        = "cell:double",
+	[VAL_CHR]        = "cell:char",
+	[VAL_STR]        = "cell:string",
+	[VAL_FCN]        = "cell:builtin",
+	[VAL_LBA]        = "cell:lambda",
+	[CENSUS_LIST]    = "cell:list",
+	[CENSUS_ENV]     = "env",
+	[CENSUS_HTABLE]  = "htable",
+	[CENSUS_SLOTS]   = "slots",
+	[CENSUS_KEY]     = "key",
+	[CENSUS_STRING]  = "string",
+	[CENSUS_BYTES]   = "bytes"
+};
+
+// Where an object lives: the nursery, an arena by type, or an immortal arena
+// that was not mapped from an image
+#define CENSUS_NURSERY 0
+#define CENSUS_FROZEN  5
+
+static const char *const censusarenas[CENSUS_FROZEN + 1] = {
+	"nursery","fixed","buddy","large","image","frozen"
+};
+
+#define GC_TYPE_NAME(all, type) \
+	[GC_TYPE(type)] = #type, \
+	[GC_TYPE_INDIRECT(type)] = #type "*"
+
+static const char *const gctypenames[] = {
+	EACH(GC_TYPE_NAME,(,),(),GC_TYPES)
+};
+
+#define BUILTIN_NAME(all, fcn) [PREFIX_BUILTIN(,fcn)] = #fcn
+
+static const char *const builtinnames[] = {
+	EACH(BUILTIN_NAME,(,),(),BUILTINS)
+};
+
+typedef struct census_count {
+	uint64_t objects;
+	int64_t bytes;
+} census_count_t;
+
+typedef struct census_root {
+	char name[64];
+	census_count_t retained;
+} census_root_t;
+
+// The state of mem_census()
+static _Thread_local struct {
+	ptr_map_t seen;
+
+	struct {
+		census_kind_t kind;
+		void *p;
+		size_t size; // As allocated, for objects in a heap image
+	} *todo;
+	size_t maxtodo, ntodo;
+
+	census_count_t total;
+	census_count_t kinds[NUM_CENSUS_KINDS];
+	census_count_t arenas[CENSUS_FROZEN + 1];
+	census_count_t *sites; // By allocation site index
+	census_count_t root;   // Reached from the root being traced
+
+	census_root_t *roots;
+	size_t maxroots, nroots;
+} census;
+
+static void census_push(census_kind_t kind, void *p, size_t size) {
+	struct ptr_map_slot *slot;
+
+	// Nothing behind nil or an immediate
+	if(!p || CELL_IS_IMMEDIATE(p))
+		return;
+
+	// The first root to reach something gets the credit for it
+	if((slot = ptr_map_find(&census.seen,p,true))->val)
+		return;
+	slot->val = 1;
+
+	if(census.ntodo >= census.maxtodo) {
+		census.maxtodo = 1.5*(census.maxtodo + 1);
+		census.todo = realloc(census.todo,
+			census.maxtodo*sizeof *census.todo);
+		assert(census.todo);
+	}
+
+	census.todo[census.ntodo].kind = kind;
+	census.todo[census.ntodo].p = p;
+	census.todo[census.ntodo].size = size;
+	census.ntodo++;
+}
+
+static void census_push_typed(gc_type_t type, void *p) {
+	if(is_indirect(type)) {
+		if(!p)
+			return;
+		memcpy(&p,p,sizeof p);
+	}
+
+	switch(type) {
+	case GC_TYPE(cell_t):
+	case GC_TYPE_INDIRECT(cell_t):
+		census_push(CENSUS_CELL,p,cell_size(p));
+		break;
+
+	case GC_TYPE(env_t):
+	case GC_TYPE_INDIRECT(env_t):
+		census_push(CENSUS_ENV,p,env_size(p));
+		break;
+
+	case GC_TYPE(htable_t):
+	case GC_TYPE_INDIRECT(htable_t):
+		census_push(CENSUS_HTABLE,p,sizeof(htable_t));
+		break;
+
+	case GC_TYPE(lambda_t):
+	case GC_TYPE_INDIRECT(lambda_t):
+		census_push(CENSUS_LAMBDA,p,0);
+		break;
+
+	case GC_TYPE(void):
+	case GC_TYPE_INDIRECT(void):
+		census_push(CENSUS_BYTES,p,0);
+		break;
+
+	default: break;
+	}
+}
+
+static void census_push_string(string_t *str) {
+	if(str)
+		census_push(CENSUS_STRING,str,sizeof *str + str->len);
+}
+
+// Adds an object to the totals, by how much room it really takes up
+static void census_count(census_kind_t kind, void *p, size_t size) {
+	int where;
+	arena_t *arena;
+	struct ptr_map_slot *slot;
+
+	if(IS_YOUNG(p)) {
+		where = CENSUS_NURSERY;
+		size = sizeof(cell_t);
+	} else {
+		arena = arena_of(p);
+
+		switch(arena->flags&ARENA_TYPE_MASK) {
+		case ARENA_FIXED:
+			size = arena->size;
+			break;
+
+		case ARENA_BUDDY:
+			size = 1 << BUDDY_MIN_EXP
+				+ (*BUDDY_FLAGSP(arena,p)&BUDDY_SIZE_MASK);
+			break;
+
+		case ARENA_LARGE:
+			size = arena->size;
+			break;
+
+		// Image objects are packed, so only their own size is known
+		case ARENA_IMAGE:
+			size = size + IMAGE_GRANULE - 1&~(IMAGE_GRANULE - 1);
+			break;
+		}
+
+		if((arena->flags&ARENA_TYPE_MASK) != ARENA_IMAGE
+			&& arena->flags&ARENA_IMMORTAL)
+			where = CENSUS_FROZEN;
+		else where = (arena->flags&ARENA_TYPE_MASK) + 1;
+	}
+
+	census.total.objects++;
+	census.total.bytes += size;
+	census.kinds[kind].objects++;
+	census.kinds[kind].bytes += size;
+	census.arenas[where].objects++;
+	census.arenas[where].bytes += size;
+	census.root.objects++;
+	census.root.bytes += size;
+
+	if(censussites) {
+		slot = ptr_map_find(&heap->allocsitesof,p,false);
+		census.sites[slot ? slot->val : 0].objects++;
+		census.sites[slot ? slot->val : 0].bytes += size;
+	}
+}
+
+// Queues up a table's slots and what is in them; valueless keys are weak, as
+// far as marking goes
+static void census_slots(htable_t *tab, hslot_t *slots, uint32_t cap) {
+	void *key;
+	uint8_t *ctrl;
+	hslot_t *slot;
+
+	census_push(CENSUS_SLOTS,slots,HTABLE_SIZE(cap));
+
+	ctrl = HTABLE_CTRL(slots,cap);
+	for(uint32_t i = 0; i < cap; i++) {
+		slot = slots + i;
+		if(!HTABLE_FULL(ctrl[i]) || slot->type == GC_TYPE(etc))
+			continue;
+
+		if(!HSLOT_KEY_INLINE(slot))
+			census_push(CENSUS_KEY,slot->key,slot->keylen);
+
+		if(tab->keyrefs) {
+			memcpy(&key,HSLOT_KEY(slot),sizeof key);
+			census_push_string(key);
+		}
+
+		census_push_typed(slot->type,slot->p);
+	}
+}
+
+// Counts an object and queues up whatever it refers to, the way scanning does
+static void census_scan(census_kind_t kind, void *p, size_t size) {
+	cell_t *cell;
+	env_t *env;
+	htable_t *tab;
+	lambda_t *lamb;
+
+	switch(kind) {
+	case CENSUS_CELL:
+		cell = p;
+		switch(cell_type(cell)) {
+		case VAL_SYM:
+		case VAL_STR:
+			census_push_string(cell->str);
+			break;
+
+		case VAL_LBA:
+			census_scan(CENSUS_LAMBDA,cell_lba(cell),0);
+			break;
+
+		case VAL_LST:
+			census_push(CENSUS_CELL,cell->car,
+				cell_size(cell->car));
+			census_push(CENSUS_CELL,cell->cdr,
+				cell_size(cell->cdr));
+			break;
+
+		default: break;
+		}
+
+		kind = cell_type(cell) < NUM_VAL_TYPES ? cell_type(cell)
+			: CENSUS_LIST;
+		break;
+
+	case CENSUS_LAMBDA:
+		lamb = p;
+		census_push(CENSUS_ENV,lamb->env,env_size(lamb->env));
+		census_push(CENSUS_CELL,lamb->args,cell_size(lamb->args));
+		census_push(CENSUS_CELL,lamb->body,cell_size(lamb->body));
+		return;
+
+	case CENSUS_ENV:
+		env = p;
+		census_push(CENSUS_ENV,env->parent,env_size(env->parent));
+		census_push(CENSUS_HTABLE,env->tab,sizeof(htable_t));
+
+		for(uint32_t i = 0; i < env->nslots; i++) {
+			census_push_string(env->slots[i].sym);
+			census_push_typed(GC_TYPE(cell_t),env->slots[i].val);
+		}
+		break;
+
+	case CENSUS_HTABLE:
+		tab = p;
+		census_slots(tab,tab->slots,tab->cap);
+		if(tab->oldslots)
+			census_slots(tab,tab->oldslots,tab->oldcap);
+		break;
+
+	default: break;
+	}
+
+	census_count(kind,p,size);
+}
+
+// Traces everything the current root reaches that no earlier root did
+static void census_root(char *name) {
+	census_root_t *root;
+
+	census.root = (census_count_t) {0,0};
+
+	while(census.ntodo) {
+		census.ntodo--;
+		census_scan(census.todo[census.ntodo].kind,
+			census.todo[census.ntodo].p,
+			census.todo[census.ntodo].size);
+	}
+
+	if(!census.root.objects)
+		return;
+
+	if(census.nroots >= census.maxroots) {
+		census.maxroots = 1.5*(census.maxroots + 1);
+		census.roots = realloc(census.roots,
+			census.maxroots*sizeof *census.roots);
+		assert(census.roots);
+	}
+
+	root = census.roots + census.nroots++;
+	snprintf(root->name,sizeof root->name,"%s",name);
+	root->retained = census.root;
+}
+
+#define CENSUS_TYPE(t, sq) CENSUS_TYPE_(t, sq)
+#define CENSUS_TYPE_(type, squal) census_##type##_##squal
+
+static void CENSUS_TYPE(bool,       )(bool x)        { (void) x; }
+static void CENSUS_TYPE(double,     )(double x)      { (void) x; }
+static void CENSUS_TYPE(int64_t,    )(int64_t x)     { (void) x; }
+static void CENSUS_TYPE(cell_type_t,)(cell_type_t x) { (void) x; }
+
+static void CENSUS_TYPE(cell_t,p)(cell_t *x) {
+	census_push_typed(GC_TYPE(cell_t),x);
+}
+
+static void CENSUS_TYPE(cell_t,pp)(cell_t **x) {
+	census_push_typed(GC_TYPE_INDIRECT(cell_t),x);
+}
+
+static void CENSUS_TYPE(env_t,p)(env_t *x) {
+	census_push_typed(GC_TYPE(env_t),x);
+}
+
+static void CENSUS_TYPE(lambda_t,p)(lambda_t *x) {
+	census_push_typed(GC_TYPE(lambda_t),x);
+}
+
+#define CENSUS_SHIM(all, var) CENSUS_SHIM_(all, var)
+#define CENSUS_SHIM_(t, q, v) CENSUS_SHIM__(t, q, SQUAL_##q, v)
+#define CENSUS_SHIM__(t, q, sq, v) CENSUS_SHIM___(t, q, sq, v)
+#define CENSUS_SHIM___(type, qual, squal, var) \
+static inline void census_var_##var(type QUAL_##qual x) { \
+	CENSUS_TYPE(type,squal)(x); \
+}
+
+#define CENSUS_SHIMS(all, def) CENSUS_SHIMS_ def
+#define CENSUS_SHIMS_(type, qual, vars) \
+	DEFER(EACH_INDIRECT)()(CENSUS_SHIM,(),(type, qual),LITERAL vars)
+
+EXPAND(EACH(CENSUS_SHIMS,(),(),EVAL_VARS))
+
+#define CENSUS_VAR_FROM_DATA(all, var) do { \
+	memcpy(&evalvars.var,data,sizeof evalvars.var); \
+	data += sizeof evalvars.var; \
+	census_var_##var(evalvars.var); \
+	snprintf(name,sizeof name,"stack:%u:%s:%s",depth,builtinnames[type], \
+		#var); \
+	census_root(name); \
+} while(0)
+
+static int compare_sites(const void *a, const void *b) {
+	int cmp;
+	alloc_site_t *sa, *sb;
+	census_count_t *ca, *cb;
+
+	ca = census.sites + *(uint32_t *) a;
+	cb = census.sites + *(uint32_t *) b;
+	if(ca->bytes != cb->bytes)
+		return ca->bytes < cb->bytes ? 1 : -1;
+
+	sa = heap->allocsites + *(uint32_t *) a;
+	sb = heap->allocsites + *(uint32_t *) b;
+	if(cmp = strcmp(sa->file,sb->file))
+		return cmp;
+	if(sa->line != sb->line)
+		return sa->line < sb->line ? -1 : 1;
+	return strcmp(sa->name,sb->name);
+}
+
+static int compare_roots(const void *a, const void *b) {
+	const census_root_t *ra, *rb;
+
+	ra = a;
+	rb = b;
+	if(ra->retained.bytes != rb->retained.bytes)
+		return ra->retained.bytes < rb->retained.bytes ? 1 : -1;
+
+	return strcmp(ra->name,rb->name);
+}
+
+static void census_print(char *section, const char *key,
+	census_count_t *count) {
+	fprintf(stderr,"census\t%s\t%s\t%llu\t%lld\n",section,key,
+		(unsigned long long) count->objects,(long long) count->bytes);
+}
+
+// Collects, then reports what is live by kind, by arena, by allocation site
+// and by the root that keeps it alive, as tab-separated lines on stderr
+void mem_census(stack_t *stack) {
+	struct {
+		EXPAND(EACH(PRINT_VARS,(;),(),EVAL_VARS));
+	} evalvars;
+
+	void *p;
+	char *data, key[64], name[64];
+	unsigned depth;
+	uint32_t *order, norder;
+	alloc_site_t *site;
+	enum builtin type;
+	immortal_ref_t *ref;
+
+	mem_gc_now(stack);
+
+	census.sites = calloc(censussites ? heap->nallocsites : 1,
+		sizeof *census.sites);
+	assert(census.sites);
+
+	// The stack's root set, from the bottom up
+	depth = 0;
+	data = stack->bottom;
+	while(data < stack->top) {
+		type = *(enum builtin *) data;
+		data += sizeof type;
+
+		switch(type) {
+			EXPAND(EACH(HANDLE_STACK_FRAME,(;),
+				(CENSUS_VAR_FROM_DATA),BUILTINS));
+		}
+
+		data += sizeof(jmp_buf);
+		depth++;
+	}
+
+	// The handles' root set
+	for(uint32_t i = 0; i < heap->nhandles; i++) {
+		census_push_typed(heap->handles[i].type,heap->handles[i].p);
+		snprintf(name,sizeof name,"handle:%u:%s%s",i,
+			gctypenames[heap->handles[i].type],
+			heap->handles[i].weak ? ":weak" : "");
+		census_root(name);
+	}
+
+	// Whatever immortal objects have been changed to point to
+	for(size_t i = 0; i < heap->immortalrefcap; i++) {
+		if(!(ref = heap->immortalrefs + i)->p)
+			continue;
+
+		if(ref->whole)
+			census_push_typed(ref->type,ref->p);
+		else {
+			memcpy(&p,ref->p,sizeof p);
+			census_push_typed(ref->type,p);
+		}
+	}
+	census_root("immortal");
+
+	census_print("total","-",&census.total);
+
+	for(int i = 0; i < NUM_CENSUS_KINDS; i++)
+		if(census.kinds[i].objects)
+			census_print("kind",censuskinds[i],census.kinds + i);
+
+	for(int i = 0; i <= CENSUS_FROZEN; i++)
+		if(census.arenas[i].objects)
+			census_print("arena",censusarenas[i],census.arenas + i);
+
+	if(censussites) {
+		order = malloc(heap->nallocsites*sizeof *order);
+		assert(order);
+
+		norder = 0;
+		for(uint32_t i = 0; i < heap->nallocsites; i++)
+			if(census.sites[i].objects)
+				order[norder++] = i;
+		qsort(order,norder,sizeof *order,compare_sites);
+
+		for(uint32_t i = 0; i < norder; i++) {
+			site = heap->allocsites + order[i];
+			if(order[i])
+				snprintf(key,sizeof key,"%s:%u:%s",site->file,
+					(unsigned) site->line,site->name);
+			else snprintf(key,sizeof key,"-");
+			census_print("site",key,census.sites + order[i]);
+		}
+
+		free(order);
+	}
+
+	qsort(census.roots,census.nroots,sizeof *census.roots,compare_roots);
+	for(size_t i = 0; i < census.nroots && i < CENSUS_TOP_ROOTS; i++)
+		census_print("root",census.roots[i].name,
+			&census.roots[i].retained);
+
+	ptr_map_free(&census.seen);
+	free(census.todo);
+	free(census.sites);
+	free(census.roots);
+	memset(&census,0,sizeof census);
+}
+
+void mem_get_stats(mem_stats_t *stats) {
+	stats->cycles = heap->gccycles;
+	stats->minors = heap->gcminors;
+
+	stats->marktime = heap->gctotalmarktime;
+	stats->sweeptime = atomic_load(&heap->gcsweepns)/1e9;
+
+	stats->reclaimedfixed = atomic_load(&heap->gcreclaimed[ARENA_FIXED]);
+	stats->reclaimedbuddy = atomic_load(&heap->gcreclaimed[ARENA_BUDDY]);
+	stats->reclaimedlarge = atomic_load(&heap->gcreclaimed[ARENA_LARGE]);
+
+	stats->heapsize = heap->heapsize;
+	stats->heapused = heap->heapused;
+	stats->immortal = heap->immortalsize;
+	stats->pruned = heap->gcpruned;
+
+	stats->npauses = heap->gcnpauses;
+	memcpy(stats->pauses,heap->gcpauses,sizeof stats->pauses);
+	stats->maxpause = heap->gctotalmaxpause;
+}
+
+// Seconds that fraction p of the pauses came in under; only the bucket is
+// known for sure, so the pauses in it are taken to be spread evenly across it
+double mem_pause_percentile(mem_stats_t *stats, double p) {
+	int i;
+	uint64_t n, rank;
+	double lo, hi;
+
+	if(!stats->npauses)
+		return 0;
+
+	// Counting from 1
+	rank = fmax(ceil(p*stats->npauses),1);
+
+	n = 0;
+	for(i = 0; i < MEM_PAUSE_BUCKETS - 1 && n + stats->pauses[i] < rank; i++)
+		n += stats->pauses[i];
+
+	// Microseconds; the last bucket goes on as far as the longest pause
+	lo = i ? 1 << i : 0;
+	hi = i < MEM_PAUSE_BUCKETS - 1 ? 2 << i : fmax(1e6*stats->maxpause,lo);
+
+	return fmin((lo + (hi - lo)*(rank - n)/stats->pauses[i])/1e6,
+		stats->maxpause);
+}
+
+void mem_print_stats() {
+	mem_stats_t stats;
+
+	mem_get_stats(&stats);
+
+	fprintf(stderr,"gc: %llu cycles, %llu minor collections\n",
+		(unsigned long long) stats.cycles,
+		(unsigned long long) stats.minors);
+	fprintf(stderr,"gc: %.3f ms marking, %.3f ms sweeping\n",
+		1e3*stats.marktime,1e3*stats.sweeptime);
+	fprintf(stderr,"gc: reclaimed %lli fixed, %lli buddy, %lli large bytes\n",
+		(long long) stats.reclaimedfixed,
+		(long long) stats.reclaimedbuddy,
+		(long long) stats.reclaimedlarge);
+	fprintf(stderr,"gc: heap size %lli, %lli in use, %lli immortal\n",
+		(long long) stats.heapsize,(long long) stats.heapused,
+		(long long) stats.immortal);
+	fprintf(stderr,"gc: pruned %llu weak hashtable entries\n",
+		(unsigned long long) stats.pruned);
+	fprintf(stderr,"gc: %llu pauses, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		(unsigned long long) stats.npauses,
+		1e3*mem_pause_percentile(&stats,0.5),
+		1e3*mem_pause_percentile(&stats,0.99),1e3*stats.maxpause);
+
+	for(int i = 0; i < MEM_PAUSE_BUCKETS; i++)
+		if(stats.pauses[i])
+			fprintf(stderr,"gc:\t%s%8i us: %llu\n",
+				i < MEM_PAUSE_BUCKETS - 1 ? "<" : ">=",
+				i < MEM_PAUSE_BUCKETS - 1 ? 2 << i : 1 << i,
+				(unsigned long long) stats.pauses[i]);
+}
+
+void mem_print_size_histogram() {
+	int i;
+	uint64_t count, granted, requested;
+
+	count = granted = requested = 0;
+	for(i = 0; i < (int) (sizeof heap->sizecounts
+		/sizeof *heap->sizecounts); i++) {
+		count += heap->sizecounts[i].count;
+		granted += heap->sizecounts[i].granted;
+		requested += heap->sizecounts[i].requested;
+	}
+
+	fprintf(stderr,"alloc: %llu allocations, %llu bytes requested, "
+		"%llu granted (%.1f%% lost to rounding)\n",
+		(unsigned long long) count,(unsigned long long) requested,
+		(unsigned long long) granted,
+		granted ? 100.*(granted - requested)/granted : 0.);
+
+	for(i = 0; i < (int) (sizeof heap->sizecounts
+		/sizeof *heap->sizecounts); i++) {
+		if(!heap->sizecounts[i].count)
+			continue;
+
+		fprintf(stderr,"alloc:\t%s%10llu B: %llu (%.1f%%), %llu B lost\n",
+			i <= SIZE_HIST_EXACT ? "  " : "<=",
+			i <= SIZE_HIST_EXACT ? (unsigned long long) i
+				: 1ull << i - SIZE_HIST_EXACT - 1,
+			(unsigned long long) heap->sizecounts[i].count,
+			100.*heap->sizecounts[i].count/count,
+			(unsigned long long) (heap->sizecounts[i].granted
+				- heap->sizecounts[i].requested));
+	}
+}
+
+// Gives the calling thread a heap of its own, set up by the settings so far;
+// each thread that runs an interpreter needs one before allocating anything
+void mem_init() {
+	assert(!heap);
+
+	pthread_once(&fixedclassesonce,init_fixed_classes);
+
+	heap = calloc(1,sizeof *heap);
+	assert(heap);
+
+	for(size_t i = 0; i < sizeof fixedsizes/sizeof *fixedsizes; i++)
+		heap->fixedarenas[i].size = fixedsizes[i];
+
+	pthread_mutex_init(&heap->sweepmutex,NULL);
+	pthread_cond_init(&heap->sweepstart,NULL);
+	pthread_cond_init(&heap->sweepdone,NULL);
+
+	pthread_mutex_init(&heap->markmutex,NULL);
+	pthread_cond_init(&heap->markstart,NULL);
+	pthread_cond_init(&heap->markdone,NULL);
+
+	heap->gcinvert = true;
+	set_trigger();
+
+	if(censussites) {
+		heap->maxallocsites = 1 << 8;
+		heap->allocsites = malloc(heap->maxallocsites
+			*sizeof *heap->allocsites);
+		assert(heap->allocsites);
+
+		heap->allocsites[0] = (alloc_site_t) {"-","-",0};
+		heap->nallocsites = 1;
+	}
+}
+
+void mem_set_growth(double growth) {
+	if(!(growth >= 1))
+		die("GC growth factor must be at least 1");
+
+	gcgrowth = growth;
+	if(heap)
+		set_trigger();
+}
+
+void mem_set_min_heap(int64_t bytes) {
+	gcminheap = bytes;
+	if(heap)
+		set_trigger();
+}
+
+void mem_set_limit(int64_t bytes) {
+	gclimit = bytes;
+	if(heap)
+		set_trigger();
+}
+
+void mem_set_mark_threads(unsigned n) {
+	if(n < 1 || n > GC_MAX_MARK_THREADS)
+		die("need between 1 and %u marker threads",GC_MAX_MARK_THREADS);
+
+	// Each heap sizes its pool by this
+	assert(!heap);
+
+	nmarkers = n;
+}
+
+void mem_set_mark_budget(size_t n) {
+	if(n < 1)
+		die("GC mark budget must be at least 1");
+
+	gcmarkbudget = n;
+}
+
+void mem_set_size_histogram(bool on) {
+	sizehist = on;
+}
+
+void mem_set_sweep_thread(bool on) {
+	// Each heap decides whether to start a sweeper when it is made
+	assert(!heap);
+
+	sweepthread = on;
+}
+
+// Whether to note where each object is allocated, for mem_census()
+void mem_set_census_sites(bool on) {
+	assert(!heap);
+
+	censussites = on;
+}
+
+void mem_set_compact(bool on) {
+	gccompact = on;
+}
+
+void mem_set_huge_pages(bool on) {
+	int i;
+
+	// Spaces reserved from here on get advised as they come
+	if((hugepages = on) && heap)
+		for(i = 0; i < heap->narenaspaces; i++)
+			advise_huge_pages(heap->arenaspaces + i);
+}
+
+uint32_t mem_new_handle(gc_type_t type) {
+	assert(type != GC_TYPE(etc));
+
+	if(heap->nhandles >= heap->maxhandles) {
+		heap->maxhandles = 1.5*(heap->maxhandles + 1);
+		heap->handles = realloc(heap->handles,
+			heap->maxhandles*sizeof *heap->handles);
+		assert(heap->handles);
+	}
+
+	heap->handles[heap->nhandles].type = type;
+	heap->handles[heap->nhandles].p = NULL;
+	heap->handles[heap->nhandles].weak = false;
+
+	return heap->nhandles++;
+}
+
+// Makes the hashtable behind a handle give up its valueless entries, once
+// nothing else refers to their keys
+void mem_set_handle_weak(uint32_t handle) {
+	assert(handle < heap->nhandles
+		&& heap->handles[handle].type == GC_TYPE(htable_t));
+
+	heap->handles[handle].weak = true;
+}
+
+void *mem_get_handle(uint32_t handle) {
+	assert(handle < heap->nhandles);
+
+	return heap->handles[handle].p;
+}
+
+void *mem_set_handle(uint32_t handle, void *p) {
+	assert(handle < heap->nhandles);
+
+	heap->handles[handle].p = p;
+
+	return p;
+}
+
+
+// What an image object is, and so which of its words are pointers
+typedef enum image_kind {
+	IMAGE_BYTES, // Strings; nothing to relocate
+	IMAGE_CELL,
+	IMAGE_ENV,
+	IMAGE_HTABLE,
+	IMAGE_SLOTS  // Copied along with their table, which knows their layout
+} image_kind_t;
+
+typedef struct image_object {
+	void *p;
+	uint32_t off, size;
+	image_kind_t kind;
+	bool strkeys; // Hashtable parts: keys point to strings (environments)
+} image_object_t;
+
+typedef struct image_header {
+	char magic[8];
+	uint32_t version;
+
+	// The layout the image depends on
+	uint16_t sizes[6];
+	uint32_t arenasize;
+
+	uint32_t nroots, nrelocs, nrehash;
+	uint64_t base;    // Where the image's pointers assume it is
+	uint64_t size;    // Bytes of arenas
+	uint64_t arenaat; // Page-aligned file offset of the arenas
+} image_header_t;
+
+typedef struct image_root {
+	gc_type_t type;
+	uint32_t off; // UINT32_MAX for NULL
+} image_root_t;
+
+// The state of mem_dump_image()
+static _Thread_local struct {
+	image_object_t *objs; // In the order they were found
+	size_t maxobjs, nobjs;
+
+	uint32_t *index; // Open addressing on address; objs index + 1
+	size_t indexcap;
+
+	char *buf;
+	size_t bufsize;
+	uint32_t top;
+
+	uint32_t *relocs, *rehash; // Offsets of pointers and hashtables
+	size_t maxrelocs, nrelocs, maxrehash, nrehash;
+} image;
+
+static void image_header_init(image_header_t *h) {
+	memset(h,0,sizeof *h);
+	memcpy(h->magic,IMAGE_MAGIC,sizeof IMAGE_MAGIC);
+	h->version = IMAGE_VERSION;
+
+	h->sizes[0] = sizeof(cell_t);
+	h->sizes[1] = sizeof(lambda_t);
+	h->sizes[2] = sizeof(env_t);
+	h->sizes[3] = sizeof(htable_t);
+	h->sizes[4] = sizeof(hslot_t);
+	h->sizes[5] = CELL_TAG_BITS;
+	h->arenasize = ARENA_SIZE;
+}
+
+static void image_push(uint32_t **array, size_t *max, size_t *n,
+	uint32_t x) {
+	if(*n >= *max) {
+		*max = 1.5*(*max + 1);
+		*array = realloc(*array,*max*sizeof **array);
+		assert(*array);
+	}
+
+	(*array)[(*n)++] = x;
+}
+
+static void image_index_grow() {
+	size_t i, j, oldcap;
+	uint32_t *old;
+
+	old = image.index;
+	oldcap = image.indexcap;
+
+	image.indexcap = oldcap ? 2*oldcap : 1 << 12;
+	image.index = calloc(image.indexcap,sizeof *image.index);
+	assert(image.index);
+
+	for(i = 0; i < oldcap; i++) {
+		if(!old[i])
+			continue;
+
+		j = hash_ptr(image.objs[old[i] - 1].p)&(image.indexcap - 1);
+		while(image.index[j])
+			j = (j + 1)&(image.indexcap - 1);
+		image.index[j] = old[i];
+	}
+
+	free(old);
+}
+
+// Where p goes in the image, finding it a place if it has none yet
+static uint32_t image_place(void *p, image_kind_t kind, size_t size,
+	bool strkeys) {
+	size_t i;
+	image_object_t *obj;
+
+	if(2*image.nobjs >= image.indexcap)
+		image_index_grow();
+
+	i = hash_ptr(p)&(image.indexcap - 1);
+	for(; image.index[i]; i = (i + 1)&(image.indexcap - 1))
+		if(image.objs[image.index[i] - 1].p == p)
+			return image.objs[image.index[i] - 1].off;
+
+	if(size > ARENA_SIZE - IMAGE_HEADSIZE)
+		die("object of %lli bytes too big for a heap image",
+			(long long) size);
+
+	// Objects never straddle arenas
+	image.top = image.top + IMAGE_GRANULE - 1&~(IMAGE_GRANULE - 1);
+	if(image.top%ARENA_SIZE == 0
+		|| ARENA_SIZE - image.top%ARENA_SIZE < size)
+		image.top = (image.top + ARENA_SIZE - 1)/ARENA_SIZE*ARENA_SIZE
+			+ IMAGE_HEADSIZE;
+
+	if((uint64_t) image.top + size > UINT32_MAX)
+		die("heap image too big");
+
+	if(image.nobjs >= image.maxobjs) {
+		image.maxobjs = 1.5*(image.maxobjs + 1);
+		image.objs = realloc(image.objs,
+			image.maxobjs*sizeof *image.objs);
+		assert(image.objs);
+	}
+
+	obj = image.objs + image.nobjs++;
+	obj->p = p;
+	obj->off = image.top;
+	obj->size = size;
+	obj->kind = kind;
+	obj->strkeys = strkeys;
+
+	image.index[i] = image.nobjs;
+	image.top += size;
+
+	return obj->off;
+}
+
+// Points a slot in the image at wherever p goes
+static void image_slot(uint32_t slot, void *p, image_kind_t kind,
+	size_t size, bool strkeys) {
+	uintptr_t off;
+
+	// Nothing to relocate for nil and immediates
+	if(!p || CELL_IS_IMMEDIATE(p))
+		return;
+
+	off = IMAGE_BASE + image_place(p,kind,size,strkeys);
+	memcpy(image.buf + slot,&off,sizeof off);
+
+	image_push(&image.relocs,&image.maxrelocs,&image.nrelocs,slot);
+}
+
+static void image_reserve(size_t end) {
+	size_t size;
+
+	if(end <= image.bufsize)
+		return;
+
+	size = image.bufsize;
+	image.bufsize = (end + ARENA_SIZE - 1)/ARENA_SIZE*ARENA_SIZE;
+	image.buf = realloc(image.buf,image.bufsize);
+	assert(image.buf);
+	memset(image.buf + size,0,image.bufsize - size);
+}
+
+static size_t image_string_size(string_t *str) {
+	return str ? sizeof *str + str->len : 0;
+}
+
+#define IMAGE_CELL_SLOT(cell, off, field) \
+	image_slot((off) + offsetof(cell_t,field),(cell)->field,IMAGE_CELL, \
+		cell_size((cell)->field),false)
+
+// Copies a table's slots into the image; those of a table keyed on string
+// addresses get laid out again, as they will hash when mapped at IMAGE_BASE
+static void image_slots(htable_t *tab, uint32_t off, bool strkeys) {
+	uint8_t *ctrl;
+	uint32_t at;
+	uintptr_t key;
+	hslot_t *slot;
+	string_t *str;
+	htable_t copy;
+
+	image_reserve(off + HTABLE_SIZE(tab->cap));
+	memcpy(image.buf + off,tab->slots,HTABLE_SIZE(tab->cap));
+
+	copy = *tab;
+	copy.slots = (hslot_t *) (image.buf + off);
+	ctrl = HTABLE_CTRL(copy.slots,copy.cap);
+
+	if(strkeys) {
+		for(uint32_t i = 0; i < copy.cap; i++) {
+			if(!HTABLE_FULL(ctrl[i]))
+				continue;
+
+			slot = copy.slots + i;
+			memcpy(&str,slot->keybytes,sizeof str);
+			key = IMAGE_BASE + image_place(str,IMAGE_BYTES,
+				image_string_size(str),false);
+			memcpy(slot->keybytes,&key,sizeof key);
+		}
+
+		htable_rehash(&copy);
+	}
+
+	for(uint32_t i = 0; i < copy.cap; i++) {
+		if(!HTABLE_FULL(ctrl[i]))
+			continue;
+
+		slot = copy.slots + i;
+		at = off + i*sizeof *slot;
+
+		if(strkeys)
+			image_push(&image.relocs,&image.maxrelocs,
+				&image.nrelocs,at + offsetof(hslot_t,key));
+		else if(!HSLOT_KEY_INLINE(slot))
+			image_slot(at + offsetof(hslot_t,key),slot->key,
+				IMAGE_BYTES,slot->keylen,false);
+
+		if(slot->type == GC_TYPE(cell_t))
+			image_slot(at + offsetof(hslot_t,p),slot->p,IMAGE_CELL,
+				cell_size(slot->p),false);
+		else if(slot->type != GC_TYPE(etc))
+			die("cannot put a value of GC type %i in a heap image",
+				slot->type);
+	}
+}
+
+// Copies an object into the image, placing whatever it points to
+static void image_copy(image_object_t obj) {
+	env_t *env;
+	cell_t *cell;
+	htable_t *tab;
+	lambda_t *lamb;
+	uint32_t at, lambat;
+
+	image_reserve(obj.off + obj.size);
+
+	// A table only goes in with the one set of slots
+	if(obj.kind == IMAGE_HTABLE)
+		htable_settle(obj.p);
+
+	if(obj.kind != IMAGE_SLOTS)
+		memcpy(image.buf + obj.off,obj.p,obj.size);
+
+	switch(obj.kind) {
+	case IMAGE_BYTES: break;
+
+	case IMAGE_CELL:
+		cell = obj.p;
+		switch(cell_type(cell)) {
+		case VAL_SYM:
+		case VAL_STR:
+			image_slot(obj.off + offsetof(cell_t,str),cell->str,
+				IMAGE_BYTES,image_string_size(cell->str),false);
+			break;
+
+		case VAL_LBA:
+			lamb = cell_lba(cell);
+			lambat = obj.off + offsetof(cell_t,data);
+			image_slot(lambat + offsetof(lambda_t,env),lamb->env,
+				IMAGE_ENV,env_size(lamb->env),false);
+			image_slot(lambat + offsetof(lambda_t,args),lamb->args,
+				IMAGE_CELL,cell_size(lamb->args),false);
+			image_slot(lambat + offsetof(lambda_t,body),lamb->body,
+				IMAGE_CELL,cell_size(lamb->body),false);
+			break;
+
+		case VAL_LST:
+			IMAGE_CELL_SLOT(cell,obj.off,car);
+			IMAGE_CELL_SLOT(cell,obj.off,cdr);
+			break;
+
+		default: break;
+		}
+		break;
+
+	case IMAGE_ENV:
+		env = obj.p;
+		image_slot(obj.off + offsetof(env_t,parent),env->parent,
+			IMAGE_ENV,env_size(env->parent),false);
+		image_slot(obj.off + offsetof(env_t,tab),env->tab,IMAGE_HTABLE,
+			sizeof(htable_t),true);
+
+		for(uint32_t i = 0; i < env->nslots; i++) {
+			at = obj.off + offsetof(env_t,slots) + i*sizeof(binding_t);
+			image_slot(at + offsetof(binding_t,sym),
+				env->slots[i].sym,IMAGE_BYTES,
+				image_string_size(env->slots[i].sym),false);
+			image_slot(at + offsetof(binding_t,val),
+				env->slots[i].val,IMAGE_CELL,
+				cell_size(env->slots[i].val),false);
+		}
+		break;
+
+	case IMAGE_HTABLE:
+		tab = obj.p;
+		image_slot(obj.off + offsetof(htable_t,slots),tab->slots,
+			IMAGE_SLOTS,HTABLE_SIZE(tab->cap),obj.strkeys);
+		image_slots(tab,image_place(tab->slots,IMAGE_SLOTS,
+			HTABLE_SIZE(tab->cap),obj.strkeys),obj.strkeys);
+
+		// Keyed on string addresses, so rehashed if relocated
+		if(obj.strkeys)
+			image_push(&image.rehash,&image.maxrehash,
+				&image.nrehash,obj.off);
+		break;
+
+	case IMAGE_SLOTS: break;
+	}
+}
+
+// Writes out everything reachable from the given handles
+void mem_dump_image(char *path, uint32_t *roots, int nroots) {
+	FILE *f;
+	void *p;
+	size_t i;
+	image_header_t h;
+	image_root_t *root, *rootv;
+
+	rootv = malloc(nroots*sizeof *rootv);
+	assert(rootv);
+
+	for(int r = 0; r < nroots; r++) {
+		assert(roots[r] < heap->nhandles);
+
+		root = rootv + r;
+		root->type = heap->handles[roots[r]].type;
+		p = heap->handles[roots[r]].p;
+
+		if(!p)
+			root->off = UINT32_MAX;
+		else if(root->type == GC_TYPE(env_t))
+			root->off = image_place(p,IMAGE_ENV,env_size(p),
+				false);
+		else if(root->type == GC_TYPE(htable_t))
+			root->off = image_place(p,IMAGE_HTABLE,
+				sizeof(htable_t),false);
+		else if(root->type == GC_TYPE(cell_t))
+			root->off = image_place(p,IMAGE_CELL,
+				cell_size(p),false);
+		else die("cannot put a root of GC type %i in a heap image",
+			root->type);
+	}
+
+	// Copying finds more objects as it goes
+	for(i = 0; i < image.nobjs; i++)
+		image_copy(image.objs[i]);
+
+	image_header_init(&h);
+	h.nroots = nroots;
+	h.nrelocs = image.nrelocs;
+	h.nrehash = image.nrehash;
+	h.base = IMAGE_BASE;
+	h.size = image.top;
+	h.arenaat = sizeof h + nroots*sizeof *rootv
+		+ (image.nrelocs + image.nrehash)*sizeof(uint32_t);
+	h.arenaat = (h.arenaat + sysconf(_SC_PAGESIZE) - 1)
+		&~(sysconf(_SC_PAGESIZE) - 1);
+
+	if(!(f = fopen(path,"wb")))
+		die("cannot open '%s'",path);
+
+	fwrite(&h,sizeof h,1,f);
+	fwrite(rootv,sizeof *rootv,nroots,f);
+	fwrite(image.relocs,sizeof *image.relocs,image.nrelocs,f);
+	fwrite(image.rehash,sizeof *image.rehash,image.nrehash,f);
+	fseek(f,h.arenaat,SEEK_SET);
+	fwrite(image.buf,1,image.top,f);
+
+	if(ferror(f) || fclose(f))
+		die("cannot write '%s'",path);
+
+	debug("heap image dumped:"
+	    "\n\tobjects:     %lli"
+	    "\n\tsize:        %lli"
+	    "\n\trelocations: %lli",
+		(long long) image.nobjs,(long long) image.top,
+		(long long) image.nrelocs);
+
+	free(rootv);
+	free(image.objs);
+	free(image.index);
+	free(image.buf);
+	free(image.relocs);
+	free(image.rehash);
+	memset(&image,0,sizeof image);
+}
+
+// Maps an image in and points the given handles at its roots, which must
+// have been dumped from handles of the same types
+void mem_load_image(char *path, uint32_t *roots, int nroots) {
+	int fd;
+	char *base, **slot, *file;
+	size_t narenas;
+	uint32_t *relocs, *rehash;
+	arena_t *arena;
+	struct stat st;
+	image_header_t h, want;
+	image_root_t *rootv;
+	struct arena_space *space;
+
+	if((fd = open(path,O_RDONLY)) < 0 || fstat(fd,&st))
+		die("cannot open '%s'",path);
+
+	file = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	if(file == MAP_FAILED)
+		die("cannot map '%s'",path);
+
+	image_header_init(&want);
+	if((size_t) st.st_size < sizeof h)
+		die("'%s' is not a heap image",path);
+	memcpy(&h,file,sizeof h);
+
+	if(memcmp(h.magic,want.magic,sizeof h.magic)
+		|| h.version != want.version
+		|| memcmp(h.sizes,want.sizes,sizeof h.sizes)
+		|| h.arenasize != want.arenasize)
+		die("'%s' is not a heap image for this build",path);
+	if(h.nroots != (uint32_t) nroots
+		|| (uint64_t) st.st_size < h.arenaat + h.size)
+		die("'%s' is not a usable heap image",path);
+
+	rootv = (image_root_t *) (file + sizeof h);
+	relocs = (uint32_t *) (rootv + h.nroots);
+	rehash = relocs + h.nrelocs;
+
+	narenas = (h.size + ARENA_SIZE - 1)/ARENA_SIZE;
+
+	// Try for the address the image was written for; the whole of its
+	// arenas must be ours, or arena_of() could be fooled
+	base = MAP_FAILED;
+	if(h.base && heap->narenaspaces < MAX_ARENA_SPACES) {
+		base = mmap((void *) (uintptr_t) h.base,narenas*ARENA_SIZE,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,-1,0);
+		if(base != MAP_FAILED && base != (char *) (uintptr_t) h.base) {
+			munmap(base,narenas*ARENA_SIZE);
+			base = MAP_FAILED;
+		}
+	}
+
+	if(base != MAP_FAILED) {
+		space = heap->arenaspaces + heap->narenaspaces++;
+		space->base = base;
+		space->top = space->end = base + narenas*ARENA_SIZE;
+	} else base = carve_arenas(narenas);
+
+	// Copy-on-write, so untouched pages stay shared with the page cache
+	if(mmap(base,h.size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_FIXED,
+		fd,h.arenaat) == MAP_FAILED)
+		die("cannot map '%s'",path);
+
+	// Anywhere else, every pointer has to move
+	if(base != (char *) (uintptr_t) h.base) {
+		for(uint32_t i = 0; i < h.nrelocs; i++) {
+			slot = (char **) (base + relocs[i]);
+			if(*slot)
+				*slot = base + ((uintptr_t) *slot - h.base);
+		}
+
+		// Tables keyed on interned strings hash their addresses
+		for(uint32_t i = 0; i < h.nrehash; i++)
+			htable_rehash((htable_t *) (base + rehash[i]));
+	}
+
+	for(size_t i = 0; i < narenas; i++) {
+		arena = (arena_t *) (base + i*ARENA_SIZE);
+		arena->size = i + 1 < narenas ? ARENA_SIZE
+			: h.size - i*ARENA_SIZE;
+		arena->flags = ARENA_IMAGE | ARENA_IMMORTAL;
+		arena->blocks = (char *) arena + IMAGE_HEADSIZE;
+
+		arena->next = heap->immortalarenas;
+		heap->immortalarenas = arena;
+	}
+
+	heap->immortalsize += narenas*ARENA_SIZE;
+
+	for(int r = 0; r < nroots; r++) {
+		if(rootv[r].type != heap->handles[roots[r]].type)
+			die("'%s' has the wrong kind of roots",path);
+
+		heap->handles[roots[r]].p = rootv[r].off == UINT32_MAX ? NULL
+			: base + rootv[r].off;
+	}
+
+	munmap(file,st.st_size);
+	close(fd);
+
+	debug("heap image loaded:"
+	    "\n\tbase address: %p"
+	    "\n\tsize:         %lli"
+	    "\n\trelocated:    %s",
+		base,(long long) h.size,
+		base != (char *) (uintptr_t) h.base ? "yes" : "no");
+}
@@ -1,6 +1,7 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -13,21 +14,85 @@
 	GC_TYPE(type), \
 	GC_TYPE_INDIRECT(type)
 
-#define GC_TYPES cell_t, env_t, hentry_t, htable_t, lambda_t, void
+#define GC_TYPES cell_t, env_t, htable_t, lambda_t, void
 
 typedef enum gc_type {
 	EACH(GC_TYPE2,(,),(),GC_TYPES),
 	GC_TYPE(etc)
 } gc_type_t;
 
+#define MEM_PAUSE_BUCKETS 24
+
+typedef struct mem_stats {
+	uint64_t cycles; // Full collections finished
+	uint64_t minors; // Nursery collections
+
+	double marktime;  // Seconds
+	double sweeptime; // Seconds, whichever thread did the sweeping
+
+	// Bytes freed by sweeping
+	int64_t reclaimedfixed;
+	int64_t reclaimedbuddy;
+	int64_t reclaimedlarge;
+
+	int64_t heapsize;
+	int64_t heapused; // As of the last full collection
+	int64_t immortal; // Frozen by mem_freeze() or mapped from an image
+
+	uint64_t pruned; // Entries dropped from weak hashtables, like interned
+	                 // strings nothing else referred to
+
+	// Safepoints that did collector work; bucket i counts those under
+	// 2^(i + 1) microseconds, and the last one everything longer
+	uint64_t npauses;
+	uint64_t pauses[MEM_PAUSE_BUCKETS];
+	double maxpause; // Seconds
+} mem_stats_t;
+
 struct stack;
 
+// Where allocations are coming from, as the census attributes them; each
+// interpreter keeps these up to date
+extern _Thread_local const char *allocsite; // Builtin
+extern _Thread_local const char *allocfile;
+extern _Thread_local uint32_t allocline;
+
+void mem_init();
+
 void *mem_alloc(size_t);
+void *mem_alloc_cell();
 void *mem_dup(void *, size_t);
 void mem_gc(struct stack *);
+void mem_gc_now(struct stack *);
+void mem_freeze(struct stack *);
+void mem_census(struct stack *);
+
+void mem_get_stats(mem_stats_t *);
+double mem_pause_percentile(mem_stats_t *, double);
+void mem_print_size_histogram();
+void mem_print_stats();
+
+void mem_set_census_sites(bool);
+void mem_set_compact(bool);
+void mem_set_growth(double);
+void mem_set_huge_pages(bool);
+void mem_set_limit(int64_t);
+void mem_set_mark_budget(size_t);
+void mem_set_mark_threads(unsigned);
+void mem_set_min_heap(int64_t);
+void mem_set_size_histogram(bool);
+void mem_set_sweep_thread(bool);
+void mem_object_barrier(gc_type_t, void *);
+void mem_pin_barrier(void *);
+void mem_write_barrier(gc_type_t, void *);
 
 uint32_t mem_new_handle(gc_type_t);
+void *mem_get_handle(uint32_t);
 void *mem_set_handle(uint32_t, void *);
+void mem_set_handle_weak(uint32_t);
+
+void mem_dump_image(char *, uint32_t *, int);
+void mem_load_image(char *, uint32_t *, int);
 
 #endif
 
@@ -21,15 +21,17 @@
 #define STACK_MAX_SIZE 10000000
 #define STACK_GROWTH   1.4
 
-char *filename;
-jmp_buf checkjmp;
-stream_t *currentstream;
+// Each thread runs an interpreter of its own
+_Thread_local char *filename;
+_Thread_local jmp_buf checkjmp;
+_Thread_local stream_t *currentstream;
 
-static string_t *str_t;
-static string_t *str_unquote;
-static string_t *str_unquote_splicing;
+static _Thread_local string_t *str_t;
+static _Thread_local string_t *str_unquote;
+static _Thread_local string_t *str_unquote_splicing;
 
-static cell_t *sym_t;
+static _Thread_local cell_t *sym_t;
+static _Thread_local uint32_t sym_th;
 
 void *ParseAlloc(void *(*)(size_t));
 void ParseFree(void *, void (*)(void *));
@@ -38,6 +40,22 @@ void ParseTrace(FILE *, char *);
 
 void print(cell_t *);
 
+// Cache important symbols
+static void builtin_cache() {
+	str_t = INTERN_CONST_STRING("t");
+	str_unquote = INTERN_CONST_STRING("unquote");
+	str_unquote_splicing = INTERN_CONST_STRING("unquote-splicing");
+
+	// The handles keep these alive, and current if they move
+	mem_set_handle(mem_new_handle(GC_TYPE_INDIRECT(void)),&str_t);
+	mem_set_handle(mem_new_handle(GC_TYPE_INDIRECT(void)),&str_unquote);
+	mem_set_handle(mem_new_handle(GC_TYPE_INDIRECT(void)),
+		&str_unquote_splicing);
+
+	sym_th = mem_new_handle(GC_TYPE_INDIRECT(cell_t));
+	mem_set_handle(sym_th,(void *) &sym_t);
+}
+
 void builtin_init(env_t *env) {
 	struct {
 		char *name;
@@ -47,10 +65,14 @@ void builtin_init(env_t *env) {
 		{"atom",         FCN_ATOM},
 		{"car",          FCN_CAR},
 		{"cdr",          FCN_CDR},
+		{"census",       FCN_CENSUS},
 		{"cond",         FCN_COND},
 		{"cons",         FCN_CONS},
 		{"eq",           FCN_EQ},
 		{"eval",         FCN_EVAL},
+		{"freeze",       FCN_FREEZE},
+		{"gc",           FCN_GC},
+		{"gc-stats",     FCN_GC_STATS},
 		{"gensym",       FCN_GENSYM},
 		{"lambda",       FCN_LAMBDA},
 		{"macro",        FCN_MACRO},
@@ -65,10 +87,7 @@ void builtin_init(env_t *env) {
 		{NULL,0}
 	};
 
-	// Cache important symbols
-	str_t = INTERN_CONST_STRING("t");
-	str_unquote = INTERN_CONST_STRING("unquote");
-	str_unquote_splicing = INTERN_CONST_STRING("unquote-splicing");
+	builtin_cache();
 
 	// Canonical truth symbol
 	sym_t = cell_cons_t(VAL_SYM,str_t);
@@ -80,6 +99,14 @@ void builtin_init(env_t *env) {
 			cell_cons_t(VAL_FCN,fcn->fcn),true);
 }
 
+// For an environment that builtin_init() set up in a heap image
+void builtin_restore(env_t *env) {
+	builtin_cache();
+
+	if(!env_get(env,str_t,&sym_t))
+		die("heap image has no 't'");
+}
+
 bool readf(void *p, stream_t *s, cell_t **cell) {
 	int tok;
 	uint32_t level;
@@ -97,6 +124,7 @@ bool readf(void *p, stream_t *s, cell_t **cell) {
 
 	do {
 		tok = token_next(s,&tokval);
+		allocline = stream_lineno(s);
 		Parse(p,tok,tokval,cell);
 
 		if(tok == TOK_LPAREN) level++;
@@ -171,7 +199,10 @@ void grow_stack(stack_t *stack, size_t nbytes) {
 
 #define SET(...) VAR_ARG(SET,__VA_ARGS__)
 
-#define LABEL FUNCTION:
+#define LABEL_NAME(fcn) LABEL_NAME_(fcn)
+#define LABEL_NAME_(fcn) #fcn
+
+#define LABEL FUNCTION: allocsite = LABEL_NAME(FUNCTION);
 
 #define CALL(fcn, ...) do { \
 	*STACK_ALLOC(stack,enum builtin) = PREFIX_BUILTIN(,FUNCTION); \
@@ -188,6 +219,14 @@ void grow_stack(stack_t *stack, size_t nbytes) {
 \
 	LOAD(FUNCTION); \
 	STACK_FREE(stack,enum builtin); \
+	allocsite = LABEL_NAME(FUNCTION); \
+} while(0)
+
+// tail points either at head or into a cell that may already be old
+#define SET_TAIL(val) do { \
+	*tail = (val); \
+	if(tail != &head) \
+		mem_write_barrier(GC_TYPE(cell_t),(void *) tail); \
 } while(0)
 
 #define JMP(fcn, ...) do { \
@@ -223,18 +262,26 @@ void grow_stack(stack_t *stack, size_t nbytes) {
 	JMP(car,env,(_env),args,(_args))
 #define JMP_CDR(_env, _args) \
 	JMP(cdr,env,(_env),args,(_args))
+#define JMP_CENSUS(_env, _args) \
+	JMP(census,env,(_env),args,(_args))
 #define JMP_COND(_env, _args) \
 	JMP(cond,env,(_env),args,(_args))
 #define JMP_CONS(_env, _args) \
 	JMP(cons,env,(_env),args,(_args))
 #define JMP_EQ(_env, _args) \
 	JMP(eq,env,(_env),args,(_args))
+#define JMP_FREEZE(_env, _args) \
+	JMP(freeze,env,(_env),args,(_args))
+#define JMP_GC(_env, _args) \
+	JMP(gc,env,(_env),args,(_args))
+#define JMP_GC_STATS(_env, _args) \
+	JMP(gc_stats,env,(_env),args,(_args))
 #define JMP_GENSYM(_env, _args) \
 	JMP(gensym,env,(_env),args,(_args))
-#define JMP_LAMBDA(_env, _args) \
-	JMP(lambda,env,(_env),args,(_args))
-#define JMP_MACRO(_env, _args) \
-	JMP(macro,env,(_env),args,(_args))
+#define JMP_LAMBDA(_env, _sexp) \
+	JMP(lambda,env,(_env),sexp,(_sexp))
+#define JMP_MACRO(_env, _sexp) \
+	JMP(macro,env,(_env),sexp,(_sexp))
 #define JMP_MACROEXPAND(_env, _args) \
 	JMP(macroexpand,env,(_env),args,(_args))
 #define JMP_MACROEXPAND_1(_env, _args) \
@@ -254,19 +301,80 @@ void grow_stack(stack_t *stack, size_t nbytes) {
 #define JMP_SUB(_env, _args) \
 	JMP(sub,env,(_env),args,(_args))
 
+static cell_t *stat_cons(char *name, cell_t *val, cell_t *rest) {
+	cell_t *sym;
+
+	sym = cell_cons_t(VAL_SYM,INTERN_CONST_STRING(name));
+
+	return cell_cons(cell_cons(sym,val),rest);
+}
+
+// The collector's lifetime totals as an alist, with times in milliseconds
+static cell_t *gc_stats_alist() {
+	cell_t *alist, *bucket;
+	mem_stats_t stats;
+
+	mem_get_stats(&stats);
+
+	// Pause histogram buckets are keyed by their upper bound in microseconds
+	alist = NULL;
+	for(int i = MEM_PAUSE_BUCKETS; i--;) {
+		if(!stats.pauses[i])
+			continue;
+
+		bucket = cell_cons(cell_cons_t(VAL_I64,(int64_t) (2 << i)),
+			cell_cons_t(VAL_I64,(int64_t) stats.pauses[i]));
+		alist = cell_cons(bucket,alist);
+	}
+
+	alist = stat_cons("pause-histogram",alist,NULL);
+	alist = stat_cons("pause-max",
+		cell_cons_t(VAL_DBL,1e3*stats.maxpause),alist);
+	alist = stat_cons("pause-p99",
+		cell_cons_t(VAL_DBL,1e3*mem_pause_percentile(&stats,0.99)),alist);
+	alist = stat_cons("pause-p50",
+		cell_cons_t(VAL_DBL,1e3*mem_pause_percentile(&stats,0.5)),alist);
+	alist = stat_cons("pauses",
+		cell_cons_t(VAL_I64,(int64_t) stats.npauses),alist);
+	alist = stat_cons("pruned",
+		cell_cons_t(VAL_I64,(int64_t) stats.pruned),alist);
+	alist = stat_cons("immortal",
+		cell_cons_t(VAL_I64,stats.immortal),alist);
+	alist = stat_cons("heap-used",
+		cell_cons_t(VAL_I64,stats.heapused),alist);
+	alist = stat_cons("heap-size",
+		cell_cons_t(VAL_I64,stats.heapsize),alist);
+	alist = stat_cons("reclaimed-large",
+		cell_cons_t(VAL_I64,stats.reclaimedlarge),alist);
+	alist = stat_cons("reclaimed-buddy",
+		cell_cons_t(VAL_I64,stats.reclaimedbuddy),alist);
+	alist = stat_cons("reclaimed-fixed",
+		cell_cons_t(VAL_I64,stats.reclaimedfixed),alist);
+	alist = stat_cons("sweep-time",
+		cell_cons_t(VAL_DBL,1e3*stats.sweeptime),alist);
+	alist = stat_cons("mark-time",
+		cell_cons_t(VAL_DBL,1e3*stats.marktime),alist);
+	alist = stat_cons("minor-cycles",
+		cell_cons_t(VAL_I64,(int64_t) stats.minors),alist);
+	alist = stat_cons("cycles",
+		cell_cons_t(VAL_I64,(int64_t) stats.cycles),alist);
+
+	return alist;
+}
+
 cell_t *eval(env_t *_env, cell_t *_sexp) {
-	static int gensym_counter = 0;
+	static _Thread_local unsigned gensym_counter = 0;
 
-	static stack_t stack = {
+	static _Thread_local stack_t stack = {
 		.size = 4000,
 		.bottom = NULL
 	};
 
-	static uint32_t retvalh = ~(uint32_t) 0;
+	static _Thread_local uint32_t retvalh = ~(uint32_t) 0;
 
 	EXPAND(EACH(PRINT_VARS,(;),(),EVAL_VARS));
 
-	char *str;
+	char str[1 + 5 + 1];
 	lambda_t lamb;
 	double xdbl;
 	int64_t xi64;
@@ -302,7 +410,7 @@ LABEL
 		RETURN(sexp);
 
 	case VAL_SYM:
-		RETURN(env_get(env,sexp->sym,(cell_t **) &sexp) ? sexp : NULL);
+		RETURN(env_get_sym(env,sexp,(cell_t **) &sexp) ? sexp : NULL);
 
 	case VAL_NIL:
 	default:
@@ -314,32 +422,37 @@ LABEL
 			|| cell_type(op) == VAL_LBA),
 			"operator must be a function");
 		if(cell_type(op) == VAL_FCN) {
-			sexp = sexp->cdr;
+			// lambda and macro get the whole form, to mark it resolved
+			args = sexp->cdr;
 			switch(op->fcn) {
-			case FCN_APPEND:        JMP_APPEND(env,sexp);
-			case FCN_ATOM:          JMP_ATOM(env,sexp);
-			case FCN_CAR:           JMP_CAR(env,sexp);
-			case FCN_CDR:           JMP_CDR(env,sexp);
-			case FCN_COND:          JMP_COND(env,sexp);
-			case FCN_CONS:          JMP_CONS(env,sexp);
-			case FCN_EQ:            JMP_EQ(env,sexp);
-			case FCN_GENSYM:        JMP_GENSYM(env,sexp);
+			case FCN_APPEND:        JMP_APPEND(env,args);
+			case FCN_ATOM:          JMP_ATOM(env,args);
+			case FCN_CAR:           JMP_CAR(env,args);
+			case FCN_CDR:           JMP_CDR(env,args);
+			case FCN_CENSUS:        JMP_CENSUS(env,args);
+			case FCN_COND:          JMP_COND(env,args);
+			case FCN_CONS:          JMP_CONS(env,args);
+			case FCN_EQ:            JMP_EQ(env,args);
+			case FCN_FREEZE:        JMP_FREEZE(env,args);
+			case FCN_GC:            JMP_GC(env,args);
+			case FCN_GC_STATS:      JMP_GC_STATS(env,args);
+			case FCN_GENSYM:        JMP_GENSYM(env,args);
 			case FCN_LAMBDA:        JMP_LAMBDA(env,sexp);
 			case FCN_MACRO:         JMP_MACRO(env,sexp);
-			case FCN_MACROEXPAND:   JMP_MACROEXPAND(env,sexp);
-			case FCN_MACROEXPAND_1: JMP_MACROEXPAND_1(env,sexp);
-			case FCN_PRINT:         JMP_PRINT(env,sexp);
-			case FCN_QUASIQUOTE:    JMP_QUASIQUOTE(env,sexp);
-			case FCN_QUOTE:         JMP_QUOTE(env,sexp);
-			case FCN_ASSIGN:        JMP_ASSIGN(env,sexp);
-			case FCN_ADD:           JMP_ADD(env,sexp);
-			case FCN_SUB:           JMP_SUB(env,sexp);
+			case FCN_MACROEXPAND:   JMP_MACROEXPAND(env,args);
+			case FCN_MACROEXPAND_1: JMP_MACROEXPAND_1(env,args);
+			case FCN_PRINT:         JMP_PRINT(env,args);
+			case FCN_QUASIQUOTE:    JMP_QUASIQUOTE(env,args);
+			case FCN_QUOTE:         JMP_QUOTE(env,args);
+			case FCN_ASSIGN:        JMP_ASSIGN(env,args);
+			case FCN_ADD:           JMP_ADD(env,args);
+			case FCN_SUB:           JMP_SUB(env,args);
 
 			case FCN_EVAL:
-				check(sexp,"too few arguments to eval");
-				check(!sexp->cdr,"too many arguments to eval");
+				check(args,"too few arguments to eval");
+				check(!args->cdr,"too many arguments to eval");
 
-				EVAL(env,sexp->car);
+				EVAL(env,args->car);
 				JMP_EVAL(env,retval);
 			}
 
@@ -373,7 +486,7 @@ LABEL
 			for(head = NULL, tail = &head; !ismacro && args;
 				args = args->cdr, tail = &(*tail)->cdr) {
 				EVAL(env,args->car);
-				*tail = cell_cons(retval,NULL);
+				SET_TAIL(cell_cons(retval,NULL));
 			}
 
 			env_set(envout,template->sym,ismacro ? args : head,
@@ -399,7 +512,9 @@ LABEL
 #undef FUNCTION
 #define FUNCTION eval_lambda
 LABEL
-	lambenv = env_cons(lambp->env);
+	body = NULL;
+
+	lambenv = env_cons(lambp->env,lambp->args,lambp->nparams);
 
 	// Bind the arguments
 	BIND_ARGS(env,lambenv,lambp->args,args,lambp->ismacro);
@@ -422,10 +537,10 @@ LABEL
 
 		if(args->cdr) {
 			for(; retval; retval = retval->cdr) {
-				*tail = cell_dup(retval);
+				SET_TAIL(cell_dup(retval));
 				tail = &(*tail)->cdr;
 			}
-		} else *tail = retval;
+		} else SET_TAIL(retval);
 	}
 
 	RETURN(head);
@@ -460,6 +575,15 @@ LABEL
 
 	RETURN(retval->cdr);
 
+#undef FUNCTION
+#define FUNCTION census
+LABEL
+	check(!args,"too many arguments to census");
+
+	mem_census(&stack);
+
+	RETURN(NULL);
+
 #undef FUNCTION
 #define FUNCTION cond
 LABEL
@@ -513,9 +637,9 @@ LABEL
 
 	switch(cell_type(a)) {
 	case VAL_SYM: RETURN(a->sym == b->sym ? sym_t : NULL);
-	case VAL_I64: RETURN(a->i64 == b->i64 ? sym_t : NULL);
+	case VAL_I64: RETURN(cell_i64(a) == cell_i64(b) ? sym_t : NULL);
 	case VAL_DBL: RETURN(a->dbl == b->dbl ? sym_t : NULL);
-	case VAL_CHR: RETURN(a->chr == b->chr ? sym_t : NULL);
+	case VAL_CHR: RETURN(cell_chr(a) == cell_chr(b) ? sym_t : NULL);
 	case VAL_FCN: RETURN(a->fcn == b->fcn ? sym_t : NULL);
 	case VAL_STR: RETURN(NULL);
 	case VAL_LBA: RETURN(NULL);
@@ -526,39 +650,70 @@ LABEL
 		RETURN(NULL);
 	}
 
+#undef FUNCTION
+#define FUNCTION freeze
+LABEL
+	check(!args,"too many arguments to freeze");
+
+	mem_freeze(&stack);
+
+	RETURN(NULL);
+
+#undef FUNCTION
+#define FUNCTION gc
+LABEL
+	check(!args,"too many arguments to gc");
+
+	mem_gc_now(&stack);
+
+	RETURN(NULL);
+
+#undef FUNCTION
+#define FUNCTION gc_stats
+LABEL
+	check(!args,"too many arguments to gc-stats");
+
+	RETURN(gc_stats_alist());
+
 #undef FUNCTION
 #define FUNCTION gensym
 LABEL
 	check(!args,"too many arguments to gensym");
 
-	str = mem_alloc(1 + 5 + 1);
-	sprintf(str,"G%05i",gensym_counter++%100000);
+	// Never interned, so no other symbol can be eq to it
+	sprintf(str,"G%05u",gensym_counter++%100000);
 
-	RETURN(cell_cons_t(VAL_SYM,str));
+	RETURN(cell_cons_t(VAL_SYM,cell_str_cons(str,strlen(str))));
 
 #undef FUNCTION
 #define FUNCTION lambda
 LABEL
-	check(args,"missing lambda parameter list");
+	check(sexp->cdr,"missing lambda parameter list");
 
 	// Set up the lambda
 	lamb.ismacro = false;
+	lamb.nparams = env_count_params(sexp->cdr->car);
 	lamb.env = env;
-	lamb.args = args->car;
-	lamb.body = args->cdr;
+	lamb.args = sexp->cdr->car;
+	lamb.body = sexp->cdr->cdr;
+
+	env_resolve(env,sexp);
 
 	RETURN(cell_cons_t(VAL_LBA,&lamb));
 
 #undef FUNCTION
 #define FUNCTION macro
 LABEL
-	check(args,"missing macro parameter list");
+	check(sexp->cdr,"missing macro parameter list");
 
 	// Set up the macro
 	lamb.ismacro = true;
+	lamb.nparams = env_count_params(sexp->cdr->car);
 	lamb.env = env;
-	lamb.args = args->car;
-	lamb.body = args->cdr;
+	lamb.args = sexp->cdr->car;
+	lamb.body = sexp->cdr->cdr;
+
+	env_resolve(env,sexp);
 
 	RETURN(cell_cons_t(VAL_LBA,&lamb));
 
@@ -629,6 +784,8 @@ LABEL
 LABEL
 	// Default
 	splice = false;
+	head = NULL;
+	tail = NULL;
 
 	// atom
 	if(cell_is_atom(sexp))
@@ -668,8 +825,8 @@ LABEL
 		QUASIQUOTE_UNQUOTE(env,sexp->car,false);
 
 		if(splice)
-			*tail = retval;
-		else *tail = cell_cons(retval,NULL);
+			SET_TAIL(retval);
+		else SET_TAIL(cell_cons(retval,NULL));
 
 		for(; *tail; tail = &(*tail)->cdr);
 	}
@@ -716,7 +873,7 @@ LABEL
 		x = retval;
 
 		switch(cell_type(x)) {
-		case VAL_I64: xdbl = xi64 = x->i64; break;
+		case VAL_I64: xdbl = xi64 = cell_i64(x); break;
 		case VAL_DBL: xi64 = xdbl = x->dbl; break;
 
 		default: check(false,"argument to + not a number");
@@ -751,7 +908,7 @@ LABEL
 		x = retval;
 
 		switch(cell_type(x)) {
-		case VAL_I64: xdbl = xi64 = x->i64; break;
+		case VAL_I64: xdbl = xi64 = cell_i64(x); break;
 		case VAL_DBL: xi64 = xdbl = x->dbl; break;
 
 		default: check(false,"argument to - not a number");
@@ -800,9 +957,9 @@ void print(cell_t *sexp) {
 	switch(cell_type(sexp)) {
 	case VAL_SYM: printf("%.*s",(int) sexp->sym->len,sexp->sym->str);
 		break;
-	case VAL_I64: printf("%" PRId64,sexp->i64); break;
-	case VAL_DBL: printf("%f",sexp->dbl);       break;
-	case VAL_CHR: printf("'%c'",sexp->chr);     break;
+	case VAL_I64: printf("%" PRId64,cell_i64(sexp)); break;
+	case VAL_DBL: printf("%f",sexp->dbl);            break;
+	case VAL_CHR: printf("'%c'",cell_chr(sexp));     break;
 	case VAL_STR: printf("\"%.*s\"",(int) sexp->str->len,sexp->str->str);
 		break;
 	case VAL_FCN: printf("<fcn>");              break;
@@ -842,6 +999,10 @@ void run_file(env_t *env, FILE *in) {
 	setjmp(checkjmp);
 
 	while(true) {
+		// The reader goes by the line of each token, and evaluation by
+		// the line the form ends on
+		allocsite = "read";
+		allocfile = filename;
 		if(!readf(p,currentstream,&sexp))
 			break;
 
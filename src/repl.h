@@ -6,9 +6,10 @@
 
 #include "va_macro.h"
 
-#define BUILTINS eval, bind_args, eval_lambda, append, atom, car, cdr, cond, \
-	cons, eq, gensym, lambda, macro, macroexpand, macroexpand_1, print, \
-	quasiquote, quasiquote_unquote, quote, assign, add, sub
+#define BUILTINS eval, bind_args, eval_lambda, append, atom, car, cdr, \
+	census, cond, cons, eq, freeze, gc, gc_stats, gensym, lambda, macro, \
+	macroexpand, macroexpand_1, print, quasiquote, quasiquote_unquote, \
+	quote, assign, add, sub
 
 #define PRESERVE_eval          env, sexp, op
 #define PRESERVE_bind_args     env, envout, template, args, ismacro, head, tail
@@ -17,9 +18,13 @@
 #define PRESERVE_atom
 #define PRESERVE_car
 #define PRESERVE_cdr
+#define PRESERVE_census
 #define PRESERVE_cond          env, args, pair
 #define PRESERVE_cons          env, args, sexp
 #define PRESERVE_eq            env, args, a
+#define PRESERVE_freeze
+#define PRESERVE_gc
+#define PRESERVE_gc_stats
 #define PRESERVE_gensym
 #define PRESERVE_lambda
 #define PRESERVE_macro
@@ -60,11 +65,12 @@ enum builtin {
 
 struct env;
 
-extern char *filename;
-extern jmp_buf checkjmp;
-extern struct stream *currentstream;
+extern _Thread_local char *filename;
+extern _Thread_local jmp_buf checkjmp;
+extern _Thread_local struct stream *currentstream;
 
 void builtin_init(struct env *);
+void builtin_restore(struct env *);
 
 void run_file(struct env *, FILE *);
 
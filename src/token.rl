@@ -245,7 +245,8 @@ refill:
 
 			[a-zA-Z$_][a-zA-Z0-9$_\-]* |
 			[=+\-]                  => {
-				val->str = cell_str_cons(s->ts,s->te - s->ts);
+				val->str = cell_str_intern_span(s->ts,
+					s->te - s->ts);
 				ret = TOK_SYMBOL;
 				fbreak;
 			};
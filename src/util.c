@@ -17,7 +17,7 @@ void message(char *type, char *str, ...) {
 	fputc('\n',stderr);
 }
 
-void die(char *str, ...) {
+_Noreturn void die(char *str, ...) {
 	va_list ap;
 
 	fprintf(stderr,"error: ");
@@ -24,7 +24,7 @@
 #endif
 
 void message(char *, char *, ...);
-void die(char *, ...);
+_Noreturn void die(char *, ...);
 
 #endif
 
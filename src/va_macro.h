@@ -15,13 +15,15 @@
 	NARGS_HAS_COMMA(__VA_ARGS__), \
 	NARGS_HAS_COMMA(NARGS_COMMA __VA_ARGS__), \
 	NARGS_HAS_COMMA(NARGS_COMMA __VA_ARGS__ ()), \
-	NARGS_(__VA_ARGS__,25,24,23,22,21,20,19,18,17,16,15,14,13,12,11,10,9, \
-		8,7,6,5,4,3,2,1,0) \
+	NARGS_(__VA_ARGS__,40,39,38,37,36,35,34,33,32,31,30,29,28,27,26,25, \
+		24,23,22,21,20,19,18,17,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2, \
+		1,0) \
 )
 #define NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, \
-	_15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, n, ...) n
+	_15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, \
+	_29, _30, _31, _32, _33, _34, _35, _36, _37, _38, _39, _40, n, ...) n
 #define NARGS_HAS_COMMA(...) NARGS_(__VA_ARGS__,1,1,1,1,1,1,1,1,1,1,1,1,1,1, \
-	1,1,1,1,1,1,1,1,1,1,0,0)
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,0)
 #define NARGS_COMMA(...) ,
 #define NARGS__(a, b, c, n) NARGS___(a,b,c,n)
 #define NARGS___(a, b, c, n) NARGS___##a##b##c(n)
@@ -83,6 +85,36 @@
 	f(LITERAL all,x) LITERAL sep EACH23(f,sep,all,__VA_ARGS__)
 #define EACH25(f, sep, all, x, ...) \
 	f(LITERAL all,x) LITERAL sep EACH24(f,sep,all,__VA_ARGS__)
+#define EACH26(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH25(f,sep,all,__VA_ARGS__)
+#define EACH27(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH26(f,sep,all,__VA_ARGS__)
+#define EACH28(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH27(f,sep,all,__VA_ARGS__)
+#define EACH29(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH28(f,sep,all,__VA_ARGS__)
+#define EACH30(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH29(f,sep,all,__VA_ARGS__)
+#define EACH31(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH30(f,sep,all,__VA_ARGS__)
+#define EACH32(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH31(f,sep,all,__VA_ARGS__)
+#define EACH33(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH32(f,sep,all,__VA_ARGS__)
+#define EACH34(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH33(f,sep,all,__VA_ARGS__)
+#define EACH35(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH34(f,sep,all,__VA_ARGS__)
+#define EACH36(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH35(f,sep,all,__VA_ARGS__)
+#define EACH37(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH36(f,sep,all,__VA_ARGS__)
+#define EACH38(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH37(f,sep,all,__VA_ARGS__)
+#define EACH39(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH38(f,sep,all,__VA_ARGS__)
+#define EACH40(f, sep, all, x, ...) \
+	f(LITERAL all,x) LITERAL sep EACH39(f,sep,all,__VA_ARGS__)
 
 #define EACH(...) VAR_ARG(EACH,__VA_ARGS__)
 #define EACH_INDIRECT() EACH